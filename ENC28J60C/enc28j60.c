@@ -31,6 +31,30 @@ The RBM command is terminated by raising the CS pin.
 
 static uint8_t Enc28j60Bank;
 static uint16_t NextPacketPtr;
+static uint16_t CurrentPacketPtr;
+// transmit slot the next packet is built in
+static uint8_t TxPrepare;
+// oldest queued slot, the one on the wire if TxBusy
+static uint8_t TxHead;
+// slots queued or on the wire
+static uint8_t TxCount;
+static uint8_t TxBusy;
+static uint16_t TxLength[ENC28J60_TX_SLOTS];
+// received packets known to wait, EPKTCNT is read again once they are freed
+static uint8_t RxPending;
+// times the receive logic had to be reset
+static uint16_t RxResets;
+#if ENC28J60_SPI_COUNT
+static uint32_t SpiTransactions;
+#endif
+
+#define Enc28j60TxSlot(slot) (TXSTART_INIT + (uint16_t)(slot) * ENC28J60_TX_SLOT_SIZE)
+
+static void Enc28j60TxWait(void);
+static void Enc28j60RxReset(void);
+static void Enc28j60RxReadPointer(uint16_t next);
+static uint16_t Enc28j60RxAddress(uint16_t offset);
+static void Enc28j60DmaCopy(uint16_t address, uint16_t end, uint16_t dest);
 
 #define ENC28J60_CONTROL_PORT    PORTB
 #define ENC28J60_CONTROL_DDR     DDRB
@@ -39,8 +63,12 @@ static uint16_t NextPacketPtr;
 #define ENC28J60_CONTROL_MISO    PORTB4
 #define ENC28J60_CONTROL_SCK     PORTB5
 
-// set CS to 0 = active
+// set CS to 0 = active, every SPI transaction starts here
+#if ENC28J60_SPI_COUNT
+#define CSACTIVE do { SpiTransactions++; ENC28J60_CONTROL_PORT &= ~(1 << ENC28J60_CONTROL_CS); } while(0)
+#else
 #define CSACTIVE ENC28J60_CONTROL_PORT &= ~(1 << ENC28J60_CONTROL_CS)
+#endif
 // set CS to 1 = passive
 #define CSPASSIVE ENC28J60_CONTROL_PORT |= (1 << ENC28J60_CONTROL_CS)
 //
@@ -106,6 +134,9 @@ void Enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data)
 Reads the buffer.
 While CS pin is low the SCK starts each time SPDR is written to
 and SCK stops when transfer is done.
+The next byte is clocked in while the previous one is stored, the
+loop then fits into the 16 cycles a byte takes with SPI2X and the
+bytes follow each other without a gap.
 ********************************************************************/
 void Enc28j60ReadBuffer(uint16_t len, uint8_t* data)
 {
@@ -113,19 +144,43 @@ void Enc28j60ReadBuffer(uint16_t len, uint8_t* data)
   // issue read command
   SPDR = ENC28J60_READ_BUF_MEM;
   waitspi();
-  while(len)
+  if(len)
   {
-    len--;
-    // read data
+    // start reading the first byte
     SPDR = 0x00;
+    while(--len)
+    {
+      waitspi();
+      uint8_t byte = SPDR;
+      // start the next byte before storing this one
+      SPDR = 0x00;
+      *data++ = byte;
+    }
     waitspi();
-    *data = SPDR;
-    data++;
+    *data++ = SPDR;
   }
   *data='\0';
   CSPASSIVE;
 }
 
+/*******************************************************************
+Same as Enc28j60ReadBuffer(), but the bytes are only clocked in and
+dropped, the read pointer moves on by len.
+********************************************************************/
+void Enc28j60SkipBuffer(uint16_t len)
+{
+  CSACTIVE;
+  // issue read command
+  SPDR = ENC28J60_READ_BUF_MEM;
+  waitspi();
+  while(len--)
+  {
+    SPDR = 0x00;
+    waitspi();
+  }
+  CSPASSIVE;
+}
+
 /*******************************************************************
 Writes to the transmitter buffer.
 While CS pin is low the SCK starts each time SPDR is written to
@@ -133,39 +188,124 @@ and SCK stops when transfer is done.
 
 EWRPTL, EWRPTH, ETXNDL, ETXNDH (Transmitt start and end pointer)
 must be set prior.
+The next byte is fetched while the current one is shifted out.
 ********************************************************************/
 void Enc28j60WriteBuffer(uint16_t len, uint8_t* data)
 {
   CSACTIVE;
   // issue write command
   SPDR = ENC28J60_WRITE_BUF_MEM;
+  while(len)
+  {
+    len--;
+    uint8_t byte = *data++;
+    // write data as soon as the previous byte is out
+    waitspi();
+    SPDR = byte;
+  }
   waitspi();
+  CSPASSIVE;
+}
+
+/*******************************************************************
+Folds the 32 bit sum of 16 bit words into the one's complement sum.
+********************************************************************/
+static uint16_t Enc28j60FoldSum(uint32_t sum)
+{
+  while(sum >> 16)
+  {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return sum;
+}
+
+/*******************************************************************
+Same as Enc28j60ReadBuffer(), but adds up the bytes while the next
+one is shifted in, so they are not walked again for the checksum.
+Returns the one's complement sum of the data as 16 bit words in
+network order, not complemented.
+********************************************************************/
+uint16_t Enc28j60ReadBufferSum(uint16_t len, uint8_t* data)
+{
+  uint32_t sum = 0;
+  uint8_t odd = 0;
+  CSACTIVE;
+  // issue read command
+  SPDR = ENC28J60_READ_BUF_MEM;
+  waitspi();
+  if(len)
+  {
+    SPDR = 0x00;
+    while(--len)
+    {
+      waitspi();
+      uint8_t byte = SPDR;
+      SPDR = 0x00;
+      *data++ = byte;
+      // the shift takes longer than the sum
+      sum += odd ? byte : (uint16_t)byte << 8;
+      odd ^= 1;
+    }
+    waitspi();
+    uint8_t byte = SPDR;
+    *data++ = byte;
+    sum += odd ? byte : (uint16_t)byte << 8;
+  }
+  *data='\0';
+  CSPASSIVE;
+  return Enc28j60FoldSum(sum);
+}
+
+/*******************************************************************
+Same as Enc28j60WriteBuffer(), but returns the one's complement sum
+of the data, computed while the bytes are shifted out.
+********************************************************************/
+uint16_t Enc28j60WriteBufferSum(uint16_t len, uint8_t* data)
+{
+  uint32_t sum = 0;
+  uint8_t odd = 0;
+  CSACTIVE;
+  // issue write command
+  SPDR = ENC28J60_WRITE_BUF_MEM;
   while(len)
   {
     len--;
-    // write data
-    SPDR = *data;
-    data++;
+    uint8_t byte = *data++;
+    sum += odd ? byte : (uint16_t)byte << 8;
+    odd ^= 1;
     waitspi();
+    SPDR = byte;
   }
+  waitspi();
   CSPASSIVE;
+  return Enc28j60FoldSum(sum);
 }
 
 /*******************************************************************
+The common registers EIE..ECON1 are in every bank and need no switch.
 If CurrentBank!=NewBank:
-  Clears the current bank select bits.
-  Sets the new bank select bits.
+  Clears the bank select bits that are set but not wanted.
+  Sets the bank select bits that are wanted but not set.
   CurrentBank=NewBank.
 end
+Switching from or to bank 0 takes a single transaction.
 ********************************************************************/
 void Enc28j60SetBank(uint8_t address)
 {
-  if((address & BANK_MASK) != Enc28j60Bank)
+  uint8_t bank = address & BANK_MASK;
+  if((address & ADDR_MASK) >= EIE || bank == Enc28j60Bank)
+  {
+    return;
+  }
+  if(Enc28j60Bank & ~bank)
+  {
+    Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, (Enc28j60Bank & ~bank)>>5);
+  }
+  if(bank & ~Enc28j60Bank)
   {
-    Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, (ECON1_BSEL1|ECON1_BSEL0));
-    Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, (address & BANK_MASK)>>5);
-    Enc28j60Bank = (address & BANK_MASK);
+    Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, (bank & ~Enc28j60Bank)>>5);
   }
+  Enc28j60Bank = bank;
 }
 
 /*******************************************************************
@@ -190,6 +330,27 @@ void Enc28j60Write(uint8_t address, uint8_t data)
   Enc28j60WriteOp(ENC28J60_WRITE_CTRL_REG, address, data);  
 }
 
+/*******************************************************************
+Write a 16 bit register pair, address is the low byte.
+The low byte is written first, as ERXRDPT requires.
+********************************************************************/
+void Enc28j60Write16(uint8_t address, uint16_t data)
+{
+  Enc28j60SetBank(address);
+  Enc28j60WriteOp(ENC28J60_WRITE_CTRL_REG, address, data & 0xFF);
+  Enc28j60WriteOp(ENC28J60_WRITE_CTRL_REG, address + 1, data >> 8);
+}
+
+#if ENC28J60_SPI_COUNT
+/*******************************************************************
+Number of SPI transactions since Enc28j60Init().
+********************************************************************/
+uint32_t Enc28j60SpiCount(void)
+{
+  return SpiTransactions;
+}
+#endif
+
 
 /*******************************************************************
 Writing a PHY register:
@@ -206,8 +367,7 @@ void Enc28j60PhyWrite(uint8_t address, uint16_t data)
   // set the PHY register address
   Enc28j60Write(MIREGADR, address);
   // write the PHY data
-  Enc28j60Write(MIWRL, data);
-  Enc28j60Write(MIWRH, data>>8);
+  Enc28j60Write16(MIWRL, data);
   // wait until the PHY write completes
   while(Enc28j60Read(MISTAT) & MISTAT_BUSY)
   {
@@ -215,6 +375,28 @@ void Enc28j60PhyWrite(uint8_t address, uint16_t data)
   }
 }
 
+/*******************************************************************
+Reading a PHY register:
+1.Write MIREGADR=address
+2.Set MICMD.MIIRD, the read starts
+3.Wait until MISTAT.BUSY is cleared
+4.Clear MICMD.MIIRD
+5.Read MIRDL and MIRDH
+********************************************************************/
+uint16_t Enc28j60PhyRead(uint8_t address)
+{
+  // set the PHY register address
+  Enc28j60Write(MIREGADR, address);
+  Enc28j60Write(MICMD, MICMD_MIIRD);
+  // wait until the PHY read completes
+  while(Enc28j60Read(MISTAT) & MISTAT_BUSY)
+  {
+    _delay_us(15);
+  }
+  Enc28j60Write(MICMD, 0x00);
+  return Enc28j60Read(MIRDL) | (Enc28j60Read(MIRDH) << 8);
+}
+
 /*******************************************************************
 Flash the 2 RJ45 LEDs twice to show that the interface works.
 
@@ -309,60 +491,43 @@ void Enc28j60Init(uint8_t* macaddr)
   Enc28j60WriteOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
   //CLKRDY is not cleared after reset. Workaround wait at least 1 ms
   _delay_ms(50);
+  // the reset selects bank 0
+  Enc28j60Bank = 0;
+#if ENC28J60_SPI_COUNT
+  SpiTransactions = 0;
+#endif
   
   // set receive buffer start address
   NextPacketPtr = RXSTART_INIT;
+  RxPending = 0;
+  RxResets = 0;
+  // all transmit slots are free
+  TxPrepare = 0;
+  TxHead = 0;
+  TxCount = 0;
+  TxBusy = 0;
   /*
   Bank 0
   */
   // 16-bit transfers, must write low byte first
-  Enc28j60Write(ERXSTL, RXSTART_INIT & 0xFF);
-  Enc28j60Write(ERXSTH, RXSTART_INIT >> 8);
+  Enc28j60Write16(ERXSTL, RXSTART_INIT);
   
-  // set receive pointer address
-  Enc28j60Write(ERXRDPTL, RXSTART_INIT & 0xFF);
-  Enc28j60Write(ERXRDPTH, RXSTART_INIT >> 8);
+  // set receive pointer address, the whole buffer is free
+  Enc28j60RxReadPointer(RXSTART_INIT);
   // RX end
-  Enc28j60Write(ERXNDL, RXSTOP_INIT & 0xFF);
-  Enc28j60Write(ERXNDH, RXSTOP_INIT >> 8);
+  Enc28j60Write16(ERXNDL, RXSTOP_INIT);
   
   // TX start
-  Enc28j60Write(ETXSTL, TXSTART_INIT & 0xFF);
-  Enc28j60Write(ETXSTH, TXSTART_INIT >> 8);
+  Enc28j60Write16(ETXSTL, TXSTART_INIT);
   // TX end
-  Enc28j60Write(ETXNDL, TXSTOP_INIT & 0xFF);
-  Enc28j60Write(ETXNDH, TXSTOP_INIT >> 8);
+  Enc28j60Write16(ETXNDL, TXSTOP_INIT);
   
   /*
-  Bank1
-    Only accept unicast our mac address MAADR
-    as well as broadcast packets for ARP packets:
-    Ethernet frame:
-      Destation Address (MAC) 6 Bytes,
-      Source Address (MAC) 6 Bytes,
-      Type/Length of frame 2 Bytes, Field<1500 -> Length of Data
-      Data: 46-1500 Bytes,
-      CRC (Cyclic redundacy check) 4 Bytes
-      
-    Ethernet frame has Type=0x0608 for ARP packets.
-    AND MACADDR for BROADCAST = ff ff ff ff ff ff
-    EPMM0 - mask 0-7 byte
-    EPMM1 - mask 8-15 byte
-    EMPOH:EPMOL - offset for mask - default value 0x0000
-    EPMCSH:EPMCSL - checksum resister
-    Data bytes
-    which have corresponding mask bits programmed to ‘0’
-    are completely removed for purposes of calculating the
-    checksum.
-    EPMM0 = 0x3F
-    EPMM1 = 0x30
-    EPMCS = ~(0x0608)
+  Bank1:
+    ERXFCON keeps its reset value, unicast to MAADR, broadcast and
+    CRC check, until the user of the driver sets its receive policy
+    with Enc28j60SetFilter() and Enc28j60SetPattern().
   */
-  Enc28j60Write(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN);
-  Enc28j60Write(EPMM0, 0x3f);
-  Enc28j60Write(EPMM1, 0x30);
-  Enc28j60Write(EPMCSL, 0xf9);
-  Enc28j60Write(EPMCSH, 0xf7);
   
   /*
   Bank2:
@@ -395,8 +560,7 @@ void Enc28j60Init(uint8_t* macaddr)
   Enc28j60Write(MABBIPG, 0x12);
   // Set the maximum packet size which the controller will accept
   // Do not send packets longer than MAX_FRAMELEN:
-  Enc28j60Write(MAMXFLL, MAX_FRAMELEN & 0xFF);	
-  Enc28j60Write(MAMXFLH, MAX_FRAMELEN >> 8);
+  Enc28j60Write16(MAMXFLL, MAX_FRAMELEN);
 
   // write MAC address
   // NOTE: MAC address in ENC28J60 is byte-backward
@@ -409,8 +573,6 @@ void Enc28j60Init(uint8_t* macaddr)
   
   // no loopback of transmitted frames
   Enc28j60PhyWrite(PHCON2, PHCON2_HDLDIS);
-  // switch to bank 0
-  Enc28j60SetBank(ECON1);
   
   /*
   Enable interrupts.
@@ -423,38 +585,146 @@ void Enc28j60Init(uint8_t* macaddr)
         1 -> Allow interrupt events to drive the interrupt pin.
     PKTIE (Receive Packet Pending Interrupt Enable bit)
         1 -> Enable receive packet pending interrupt
+    LINKIE, TXIE, TXERIE, RXERIE
+        1 -> Link changes, sent packets and receive and transmit
+             errors are signalled too. The PHY reports link
+             changes only if PHIE.PGEIE and PHIE.PLNKIE are set.
   */
-  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE | EIE_PKTIE);
+  Enc28j60PhyWrite(PHIE, PHIE_PGEIE | PHIE_PLNKIE);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE | EIE_PKTIE | EIE_LINKIE | EIE_TXIE | EIE_TXERIE | EIE_RXERIE);
   // enable packet reception
   Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
 }
 
+/*******************************************************************
+Tracks the queued packets. Once the packet on the wire is sent its
+slot is free again and the next queued packet is started. Called
+whenever a slot is needed and on EIR.TXIF and EIR.TXERIF.
+********************************************************************/
+void Enc28j60TxPoll(void)
+{
+  if(TxCount == 0)
+  {
+    return;
+  }
+  if(TxBusy)
+  {
+    uint8_t eir = Enc28j60ReadOp(ENC28J60_READ_CTRL_REG, EIR);
+    if(!(eir & (EIR_TXIF | EIR_TXERIF)))
+    {
+      return;
+    }
+    // Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
+    if(eir & EIR_TXERIF)
+    {
+      Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+    }
+    // the flags drive the interrupt pin
+    Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXIF | EIR_TXERIF);
+    TxBusy = 0;
+    TxHead = (TxHead + 1) % ENC28J60_TX_SLOTS;
+    if(--TxCount == 0)
+    {
+      return;
+    }
+  }
+  uint16_t start = Enc28j60TxSlot(TxHead);
+  Enc28j60Write16(ETXSTL, start);
+  Enc28j60Write16(ETXNDL, start + TxLength[TxHead]);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXIF | EIR_TXERIF);
+  // send the contents of the slot onto the network
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+  TxBusy = 1;
+}
+
+/*******************************************************************
+Waits until the slot the next packet is built in is free.
+********************************************************************/
+static void Enc28j60TxWait(void)
+{
+  while(TxCount == ENC28J60_TX_SLOTS)
+  {
+    Enc28j60TxPoll();
+  }
+}
+
+/*******************************************************************
+Moves the buffer write pointer to offset bytes into the packet
+being prepared in the transmit buffer. Enc28j60WriteBuffer()
+then writes the payload straight into the controller,
+Enc28j60PacketSendHeader() adds the headers in front of it.
+********************************************************************/
+void Enc28j60TxSeek(uint16_t offset)
+{
+  Enc28j60TxWait();
+  // skip the per packet control byte
+  offset += Enc28j60TxSlot(TxPrepare) + 1;
+  Enc28j60Write16(EWRPTL, offset);
+}
+
+/*******************************************************************
+Checksum of len bytes of the controller memory starting at address,
+computed by the DMA checksum engine. A range running past the end
+of the receive buffer wraps to its start. Returns the checksum as it
+goes into a header, i.e. the complement of the one's complement sum.
+********************************************************************/
+uint16_t Enc28j60DmaChecksum(uint16_t address, uint16_t len)
+{
+  uint16_t end = address + len - 1;
+  if(address <= RXSTOP_INIT && end > RXSTOP_INIT)
+  {
+    end -= RXSTOP_INIT + 1 - RXSTART_INIT;
+  }
+  Enc28j60Write16(EDMASTL, address);
+  Enc28j60Write16(EDMANDL, end);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_CSUMEN | ECON1_DMAST);
+  // DMAST is cleared when the checksum is ready
+  while(Enc28j60ReadOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+  return (Enc28j60Read(EDMACSH) << 8) | Enc28j60Read(EDMACSL);
+}
+
+/*******************************************************************
+Checksum of len bytes written offset bytes into the packet
+being prepared in the transmit buffer.
+********************************************************************/
+uint16_t Enc28j60TxChecksum(uint16_t offset, uint16_t len)
+{
+  // skip the per packet control byte
+  return Enc28j60DmaChecksum(Enc28j60TxSlot(TxPrepare) + 1 + offset, len);
+}
+
 /*******************************************************************
 Transmitt Packet
 ********************************************************************/
 uint8_t Enc28j60PacketSend(uint16_t len, uint8_t* packet)
 {
-  // Set the write pointer to start of transmit buffer area
-  Enc28j60Write(EWRPTL, TXSTART_INIT & 0xFF);
-  Enc28j60Write(EWRPTH, TXSTART_INIT >> 8);
-  // Set the TXND pointer to correspond to the packet size given
-  Enc28j60Write(ETXNDL, (TXSTART_INIT + len) & 0xFF);
-  Enc28j60Write(ETXNDH, (TXSTART_INIT + len) >> 8);
+  return Enc28j60PacketSendHeader(len, len, packet);
+}
+
+/*******************************************************************
+Transmitt Packet of len bytes, only the first header_len bytes
+are copied, the rest is already in the transmit buffer.
+********************************************************************/
+uint8_t Enc28j60PacketSendHeader(uint16_t len, uint16_t header_len, uint8_t* header)
+{
+  Enc28j60TxWait();
+  // Set the write pointer to start of the slot
+  uint16_t start = Enc28j60TxSlot(TxPrepare);
+  Enc28j60Write16(EWRPTL, start);
   /*
   Additionally, the ENC28J60 requires a single per packet
   control byte to precede the packet for transmission.
   0x00 means use MACON3 settings (no overriding)
   */
   Enc28j60WriteOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
-  // copy the packet into the transmit buffer
-  Enc28j60WriteBuffer(len, packet);
-  // send the contents of the transmit buffer onto the network
-  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
-  // Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
-  if((Enc28j60Read(EIR) & EIR_TXERIF))
-  {
-    Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
-  }
+  // copy the headers into the transmit buffer
+  Enc28j60WriteBuffer(header_len, header);
+  // queue the slot, it is sent right away unless another one is on the wire
+  TxLength[TxPrepare] = len;
+  TxPrepare = (TxPrepare + 1) % ENC28J60_TX_SLOTS;
+  TxCount++;
+  Enc28j60TxPoll();
   return 1;
 }
 
@@ -464,8 +734,22 @@ uint8_t Enc28j60PacketSend(uint16_t len, uint8_t* packet)
 //      maxlen  The maximum acceptable length of a retrieved packet.
 //      packet  Pointer where packet data should be stored.
 // Returns: Packet length in bytes if a packet was retrieved, zero otherwise.
+// A retrieved packet stays in the receive buffer until Enc28j60PacketFree().
 ********************************************************************/
 uint16_t Enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
+{
+  uint16_t len = Enc28j60PacketReceiveHeader(maxlen, maxlen, packet);
+  // the caller only sees what was copied
+  return (len > maxlen-1) ? maxlen-1 : len;
+}
+
+/*******************************************************************
+Same as Enc28j60PacketReceive(), but only the first header_len bytes
+of the packet are copied and the length of the whole packet is
+returned, even if it does not fit into maxlen-1 bytes.
+Enc28j60PacketRead() fetches the rest if it is needed at all.
+********************************************************************/
+uint16_t Enc28j60PacketReceiveHeader(uint16_t maxlen, uint16_t header_len, uint8_t* packet)
 {
   uint16_t rxstat;
   uint16_t len;
@@ -479,15 +763,21 @@ uint16_t Enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
   if( !(enc28j60Read(EIR) & EIR_PKTIF) ){}
   The above does not work. See Rev. B4 Silicon Errata point 6.
   
+  EPKTCNT only grows until PKTDEC, so it is read once per burst
+  and not for every packet, which saves the switch to bank 1.
   */
-  if( Enc28j60Read(EPKTCNT) ==0 )
+  if(RxPending == 0)
   {
-    return(0);
+    RxPending = Enc28j60Read(EPKTCNT);
+    if(RxPending == 0)
+    {
+      return(0);
+    }
   }
 
   // Set the read pointer to the start of the received packet
-  Enc28j60Write(ERDPTL, NextPacketPtr);
-  Enc28j60Write(ERDPTH, NextPacketPtr >> 8);
+  CurrentPacketPtr = NextPacketPtr;
+  Enc28j60Write16(ERDPTL, NextPacketPtr);
 
   // read the next packet pointer
   NextPacketPtr  = Enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
@@ -496,18 +786,25 @@ uint16_t Enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
   // read the packet length (see datasheet page 43)
   len  = Enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
   len |= Enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0) << 8;
+
+  /*
+  Packets start on even addresses within the receive buffer and
+  no Ethernet frame is longer than 1522 bytes with VLAN tag and CRC.
+  Anything else means the buffer got out of step, only a reset of
+  the receive logic gets it back.
+  */
+  if(NextPacketPtr > RXSTOP_INIT || (NextPacketPtr & 1) ||
+     len > 1522 || len < 4)
+  {
+    Enc28j60RxReset();
+    return(0);
+  }
   len -= 4; //remove the CRC count
 
   // read the receive status (see datasheet page 43)
   rxstat  = Enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0);
   rxstat |= Enc28j60ReadOp(ENC28J60_READ_BUF_MEM, 0) << 8;
 
-  // limit retrieve length
-  if (len>maxlen-1)
-  {
-    len=maxlen-1;
-  }
-  
   /*
   StatusVector 16:31
   Bit23:
@@ -521,18 +818,145 @@ uint16_t Enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
   if ((rxstat & 0x80)==0)
   {
     // invalid
-    len=0;
+    Enc28j60PacketFree();
+    return(0);
   }
-  else
+  /*
+  The length of the whole packet is returned, only what fits in front
+  of the 0 the driver terminates the data with is copied.
+  */
+  if (header_len > len)
+  {
+    header_len = len;
+  }
+  if (header_len > maxlen-1)
+  {
+    header_len = maxlen-1;
+  }
+  // copy the packet from the receive buffer
+  Enc28j60ReadBuffer(header_len, packet);
+  return(len);
+}
+
+/*******************************************************************
+Address of the byte offset bytes into the packet returned by the
+last Enc28j60PacketReceive(), wrapped within the receive buffer.
+********************************************************************/
+static uint16_t Enc28j60RxAddress(uint16_t offset)
+{
+  // skip the next packet pointer and the receive status vector
+  uint16_t address = CurrentPacketPtr + 6 + offset;
+  if(address > RXSTOP_INIT)
   {
-    // copy the packet from the receive buffer
-    Enc28j60ReadBuffer(len, packet);
+    address -= RXSTOP_INIT + 1 - RXSTART_INIT;
   }
-   
+  return address;
+}
+
+/*******************************************************************
+Copies len bytes starting offset bytes into the packet returned
+by the last Enc28j60PacketReceive(). The packet must not have
+been freed.
+********************************************************************/
+void Enc28j60PacketRead(uint16_t offset, uint16_t len, uint8_t* data)
+{
+  uint16_t address = Enc28j60RxAddress(offset);
+  Enc28j60Write16(ERDPTL, address);
+  Enc28j60ReadBuffer(len, data);
+}
+
+/*******************************************************************
+Same as Enc28j60PacketRead(), returns the one's complement sum of
+the data read, see Enc28j60ReadBufferSum().
+********************************************************************/
+uint16_t Enc28j60PacketReadSum(uint16_t offset, uint16_t len, uint8_t* data)
+{
+  uint16_t address = Enc28j60RxAddress(offset);
+  Enc28j60Write16(ERDPTL, address);
+  return Enc28j60ReadBufferSum(len, data);
+}
+
+/*******************************************************************
+Checksum of len bytes starting offset bytes into the packet
+returned by the last Enc28j60PacketReceive(), see
+Enc28j60DmaChecksum(). The packet must not have been freed.
+********************************************************************/
+uint16_t Enc28j60RxChecksum(uint16_t offset, uint16_t len)
+{
+  return Enc28j60DmaChecksum(Enc28j60RxAddress(offset), len);
+}
+
+/*******************************************************************
+Copies the bytes from address to end (inclusive) to dest with the
+DMA controller, nothing goes over SPI. A range running past the end
+of the receive buffer wraps to its start.
+********************************************************************/
+static void Enc28j60DmaCopy(uint16_t address, uint16_t end, uint16_t dest)
+{
+  Enc28j60Write16(EDMASTL, address);
+  Enc28j60Write16(EDMANDL, end);
+  Enc28j60Write16(EDMADSTL, dest);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST);
+  // DMAST is cleared when the copy is done
+  while(Enc28j60ReadOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST);
+}
+
+/*******************************************************************
+Copies len bytes starting offset bytes into the packet returned by
+the last Enc28j60PacketReceive() to tx_offset bytes into the packet
+being prepared in the transmit buffer.
+********************************************************************/
+void Enc28j60PacketCopy(uint16_t offset, uint16_t len, uint16_t tx_offset)
+{
+  if(len == 0)
+  {
+    return;
+  }
+  Enc28j60TxWait();
+  // skip the per packet control byte
+  tx_offset += Enc28j60TxSlot(TxPrepare) + 1;
+  Enc28j60DmaCopy(Enc28j60RxAddress(offset), Enc28j60RxAddress(offset + len - 1), tx_offset);
+}
+
+/*******************************************************************
+Writes len bytes offset bytes into the cache, the memory reserved
+for data that is copied into packets again and again. Moves the
+buffer write pointer, so a packet must not be in preparation.
+********************************************************************/
+void Enc28j60CacheWrite(uint16_t offset, uint16_t len, uint8_t* data)
+{
+  offset += CACHESTART_INIT;
+  Enc28j60Write16(EWRPTL, offset);
+  Enc28j60WriteBuffer(len, data);
+}
+
+/*******************************************************************
+Copies len bytes starting offset bytes into the cache to tx_offset
+bytes into the packet being prepared in the transmit buffer.
+********************************************************************/
+void Enc28j60CacheCopy(uint16_t offset, uint16_t len, uint16_t tx_offset)
+{
+  if(len == 0)
+  {
+    return;
+  }
+  Enc28j60TxWait();
+  offset += CACHESTART_INIT;
+  // skip the per packet control byte
+  tx_offset += Enc28j60TxSlot(TxPrepare) + 1;
+  Enc28j60DmaCopy(offset, offset + len - 1, tx_offset);
+}
+
+/*******************************************************************
+Releases the packet returned by the last Enc28j60PacketReceive()
+once it has been handled, the controller may then overwrite it.
+********************************************************************/
+void Enc28j60PacketFree(void)
+{
   // Move the RX read pointer to the start of the next received packet
   // This frees the memory we just read out
-  Enc28j60Write(ERXRDPTL, NextPacketPtr);
-  Enc28j60Write(ERXRDPTH, NextPacketPtr >> 8);
+  Enc28j60RxReadPointer(NextPacketPtr);
 
   /*
   In addition to advancing the receive buffer read pointer,
@@ -541,7 +965,162 @@ uint16_t Enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
   will cause the EPKTCNT register to decrement by 1  
   */
   Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
-  return(len);
+  if(RxPending)
+  {
+    RxPending--;
+  }
+}
+
+/*******************************************************************
+Frees the receive buffer up to next, the start of the next packet.
+ERXRDPT must be odd, see Rev. B4 Silicon Errata point 14, the byte
+before next is written instead. Packets start on even addresses.
+********************************************************************/
+static void Enc28j60RxReadPointer(uint16_t next)
+{
+  if(next == RXSTART_INIT)
+  {
+    Enc28j60Write16(ERXRDPTL, RXSTOP_INIT);
+  }
+  else
+  {
+    Enc28j60Write16(ERXRDPTL, next - 1);
+  }
+}
+
+/*******************************************************************
+Resets the receive logic and empties the receive buffer. Packets
+waiting in it are lost, the controller receives again right away.
+********************************************************************/
+static void Enc28j60RxReset(void)
+{
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXRST);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXRST);
+  // writing ERXST moves the write pointer to it
+  Enc28j60Write16(ERXSTL, RXSTART_INIT);
+  Enc28j60Write16(ERXNDL, RXSTOP_INIT);
+  NextPacketPtr = RXSTART_INIT;
+  Enc28j60RxReadPointer(RXSTART_INIT);
+  RxPending = Enc28j60Read(EPKTCNT);
+  while(RxPending)
+  {
+    Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+    RxPending--;
+  }
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_PKTIF | EIR_RXERIF);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
+  RxResets++;
+}
+
+/*******************************************************************
+Times the receive buffer got out of step and was reset.
+********************************************************************/
+uint16_t Enc28j60RxResets(void)
+{
+  return RxResets;
+}
+
+/*******************************************************************
+Aborts the packet on the wire and drops the queued ones, e.g. when
+the link is lost and they would only go out stale.
+********************************************************************/
+void Enc28j60TxReset(void)
+{
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST | ECON1_TXRTS);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXIF | EIR_TXERIF);
+  TxHead = TxPrepare;
+  TxCount = 0;
+  TxBusy = 0;
+}
+
+/*******************************************************************
+Selects the frames the controller accepts, see ERXFCON_*.
+********************************************************************/
+void Enc28j60SetFilter(uint8_t filter)
+{
+  Enc28j60Write(ERXFCON, filter);
+}
+
+/*******************************************************************
+Programs the pattern match filter: the 64 bytes from offset bytes
+into the frame are compared, byte n counts if bit n of mask is set.
+checksum is the checksum of the counted bytes of a matching frame,
+as it goes into a header.
+********************************************************************/
+void Enc28j60SetPattern(uint16_t offset, const uint8_t* mask, uint16_t checksum)
+{
+  uint8_t i;
+  Enc28j60Write16(EPMOL, offset);
+  for(i = 0; i < 8; i++)
+  {
+    Enc28j60Write(EPMM0 + i, mask[i]);
+  }
+  Enc28j60Write16(EPMCSL, checksum);
+}
+
+/*******************************************************************
+Adds a multicast address to the hash table filter (ERXFCON_HTEN).
+Bits 28:23 of the CRC-32 of the address select the bit to set.
+********************************************************************/
+void Enc28j60HashAdd(const uint8_t* mac)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  uint8_t i, j;
+  for(i = 0; i < 6; i++)
+  {
+    uint8_t byte = mac[i];
+    // the address goes onto the wire least significant bit first
+    for(j = 0; j < 8; j++)
+    {
+      uint8_t bit = (byte ^ (crc >> 31)) & 0x01;
+      crc <<= 1;
+      if(bit)
+      {
+        crc ^= 0x04C11DB7;
+      }
+      byte >>= 1;
+    }
+  }
+  uint8_t pointer = (crc >> 23) & 0x3F;
+  Enc28j60SetBank(EHT0);
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EHT0 + (pointer >> 3), 1 << (pointer & 0x07));
+}
+
+/*******************************************************************
+The interrupt pin goes low once an enabled event flag in EIR is set
+and stays low until all of them are cleared. Enc28j60IntBegin()
+releases the pin and returns the events, Enc28j60IntEnd() enables
+it again, an event still pending then gives a new falling edge.
+********************************************************************/
+uint8_t Enc28j60IntBegin(void)
+{
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIE, EIE_INTIE);
+  return Enc28j60ReadOp(ENC28J60_READ_CTRL_REG, EIR);
+}
+
+void Enc28j60IntEnd(void)
+{
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE);
+}
+
+/*******************************************************************
+Clears event flags in EIR, PKTIF and LINKIF are read only.
+********************************************************************/
+void Enc28j60IntClear(uint8_t flags)
+{
+  Enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, flags);
+}
+
+/*******************************************************************
+Reading PHIR clears the link change event (EIR.LINKIF).
+Returns 1 if the link is up.
+********************************************************************/
+uint8_t Enc28j60LinkUp(void)
+{
+  Enc28j60PhyRead(PHIR);
+  return (Enc28j60PhyRead(PHSTAT2) & PHSTAT2_LSTAT) ? 1 : 0;
 }
 
 /*******************************************************************
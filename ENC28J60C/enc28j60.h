@@ -254,6 +254,14 @@
   #define PHCON2_TXDIS     0x2000
   #define PHCON2_JABBER    0x0400
   #define PHCON2_HDLDIS    0x0100
+  // ENC28J60 PHY PHSTAT2 Register Bit Definitions
+  #define PHSTAT2_LSTAT    0x0400
+  // ENC28J60 PHY PHIE Register Bit Definitions
+  #define PHIE_PLNKIE      0x0010
+  #define PHIE_PGEIE       0x0002
+  // ENC28J60 PHY PHIR Register Bit Definitions
+  #define PHIR_PLNKIF      0x0010
+  #define PHIR_PGIF        0x0004
 
   // ENC28J60 Packet Control Byte Bit Definitions
   #define PKTCTRL_PHUGEEN  0x08
@@ -287,8 +295,16 @@
     The pointers must not be modified while the receive
     logic is enabled (ECON1.RXEN is set).
   */
-  /*Recieve buffer end 6400 bytes*/
-  #define RXSTOP_INIT       (0x1FFF-0x0600-1)
+  /*Recieve buffer end, in front of the cache (3868 bytes)*/
+  #define RXSTOP_INIT       (CACHESTART_INIT-1)
+  
+  /*
+  Cache:
+  Data copied into many packets, like static pages, is kept in
+  front of the transmit buffer and copied by the DMA controller.
+  */
+  #define ENC28J60_CACHE_SIZE  1280
+  #define CACHESTART_INIT   (TXSTART_INIT-ENC28J60_CACHE_SIZE)
   
   /*
   Transmitt buffer:
@@ -300,9 +316,8 @@
   ETXND pointers are programmed with addresses
   specifying where, within the transmit buffer, the particular
   packet to transmit is located.
-  0x600 is 1536 bytes.
-  The transmitter buffer ranges from 0x19FF<->0x1FFD which is 1534 bytes.
-  However only 1500 bytes are used for the frame.
+  The transmitter buffer ranges from 0x141C<->0x1FFF which is 3044 bytes,
+  two slots of 1522 bytes. Each frame carries up to 1500 bytes of data.
   Since the controller adds the 18 byte header.
   which contains:
     Destation Address (MAC) 6 Bytes,
@@ -311,7 +326,21 @@
     Data: 46-1500 Bytes,
     CRC (Cyclic redundacy check) 4 Bytes
   */
-  #define TXSTART_INIT     (0x1FFF-0x0600)
+  #define TXSTART_INIT     (0x2000-ENC28J60_TX_SLOTS*ENC28J60_TX_SLOT_SIZE)
+  
+  /*
+  The transmit buffer is split into slots, the next packet is built
+  in one while the previous one is still being sent. A slot holds the
+  control byte, a frame of up to 1514 bytes and the status vector.
+  */
+  #define ENC28J60_TX_SLOTS      2
+  #define ENC28J60_TX_SLOT_SIZE  (1+1514+7)
+  
+  /*
+  Count the SPI transactions, i.e. CS frames, to measure the
+  register access overhead per packet. 0 disables.
+  */
+  #define ENC28J60_SPI_COUNT     0
   
   /*
   When the packet is finished transmitting or was aborted
@@ -321,22 +350,53 @@
   */
   #define TXSTOP_INIT      0x1FFD
   
-  #define MAX_FRAMELEN     1500
+  // 1500 bytes of payload, the ethernet header and the CRC
+  #define MAX_FRAMELEN     1518
 
   // functions
   extern uint8_t Enc28j60ReadOp(uint8_t op, uint8_t address);
   extern void Enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data);
   extern void Enc28j60ReadBuffer(uint16_t len, uint8_t* data);
+  extern void Enc28j60SkipBuffer(uint16_t len);
   extern void Enc28j60WriteBuffer(uint16_t len, uint8_t* data);
+  extern uint16_t Enc28j60ReadBufferSum(uint16_t len, uint8_t* data);
+  extern uint16_t Enc28j60WriteBufferSum(uint16_t len, uint8_t* data);
   extern void Enc28j60SetBank(uint8_t address);
   extern uint8_t Enc28j60Read(uint8_t address);
   extern void Enc28j60Write(uint8_t address, uint8_t data);
+  extern void Enc28j60Write16(uint8_t address, uint16_t data);
+#if ENC28J60_SPI_COUNT
+  extern uint32_t Enc28j60SpiCount(void);
+#endif
   extern void Enc28j60PhyWrite(uint8_t address, uint16_t data);
+  extern uint16_t Enc28j60PhyRead(uint8_t address);
+  extern void Enc28j60SetFilter(uint8_t filter);
+  extern void Enc28j60SetPattern(uint16_t offset, const uint8_t* mask, uint16_t checksum);
+  extern void Enc28j60HashAdd(const uint8_t* mac);
+  extern uint8_t Enc28j60IntBegin(void);
+  extern void Enc28j60IntEnd(void);
+  extern void Enc28j60IntClear(uint8_t flags);
+  extern uint8_t Enc28j60LinkUp(void);
   extern void Enc28j60clkout(uint8_t clk);
   extern void InitPhy (void);
   extern void Enc28j60Init(uint8_t* macaddr);
   extern uint8_t Enc28j60PacketSend(uint16_t len, uint8_t* packet);
+  extern uint8_t Enc28j60PacketSendHeader(uint16_t len, uint16_t header_len, uint8_t* header);
+  extern void Enc28j60TxSeek(uint16_t offset);
+  extern void Enc28j60TxPoll(void);
   extern uint16_t Enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet);
+  extern uint16_t Enc28j60PacketReceiveHeader(uint16_t maxlen, uint16_t header_len, uint8_t* packet);
+  extern void Enc28j60PacketRead(uint16_t offset, uint16_t len, uint8_t* data);
+  extern uint16_t Enc28j60PacketReadSum(uint16_t offset, uint16_t len, uint8_t* data);
+  extern void Enc28j60PacketCopy(uint16_t offset, uint16_t len, uint16_t tx_offset);
+  extern void Enc28j60PacketFree(void);
+  extern uint16_t Enc28j60RxResets(void);
+  extern void Enc28j60TxReset(void);
+  extern void Enc28j60CacheWrite(uint16_t offset, uint16_t len, uint8_t* data);
+  extern void Enc28j60CacheCopy(uint16_t offset, uint16_t len, uint16_t tx_offset);
+  extern uint16_t Enc28j60DmaChecksum(uint16_t address, uint16_t len);
+  extern uint16_t Enc28j60TxChecksum(uint16_t offset, uint16_t len);
+  extern uint16_t Enc28j60RxChecksum(uint16_t offset, uint16_t len);
   extern uint8_t Enc28j60getrev(void);
   
 #endif
\ No newline at end of file
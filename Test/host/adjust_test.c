@@ -0,0 +1,74 @@
+/*
+ * Host test of net_adjust_checksum() and net_adjust_checksum32(): a word
+ * or a 32 bit field of a header changes, the adjusted checksum must be
+ * the one recomputed with net_get_checksum().
+ */
+
+#include <net.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HEADER_SIZE	60
+
+static uint8_t data[HEADER_SIZE];
+static unsigned long cases;
+static unsigned long failures;
+
+static void fail(const char * test,uint16_t offset,uint16_t len,uint16_t expected,uint16_t got)
+{
+	if(failures++ < 10)
+		printf("%s: offset %u len %u: expected %04x got %04x\n",test,offset,len,expected,got);
+}
+
+static void fill(uint8_t * buffer,uint16_t len)
+{
+	uint16_t i;
+	/* mostly 0xff to carry often */
+	for(i = 0 ; i < len ; i++)
+		buffer[i] = (rand() & 3) ? 0xff : (uint8_t)rand();
+}
+
+static void check_adjust(void)
+{
+	uint16_t len = 20 + 2 * (rand() % 20);
+	uint16_t i = 2 * (rand() % (len / 2 - 1));
+	uint16_t checksum, expected, got;
+	fill(data,len);
+	checksum = ~net_get_checksum(0,data,len,1);
+	cases++;
+	if(rand() & 1)
+	{
+		uint16_t old_word = (data[i] << 8) | data[i + 1];
+		uint16_t new_word = (rand() & 1) ? (uint16_t)rand() : (uint16_t)~old_word;
+		data[i] = new_word >> 8;
+		data[i + 1] = (uint8_t)new_word;
+		got = net_adjust_checksum(checksum,old_word,new_word);
+		expected = ~net_get_checksum(0,data,len,1);
+		if(got != expected)
+			fail("adjust",i,len,expected,got);
+	}
+	else
+	{
+		uint32_t old_field = ((uint32_t)data[i] << 24) | ((uint32_t)data[i + 1] << 16) |
+			(data[i + 2] << 8) | data[i + 3];
+		uint32_t new_field = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+		data[i] = new_field >> 24;
+		data[i + 1] = (uint8_t)(new_field >> 16);
+		data[i + 2] = (uint8_t)(new_field >> 8);
+		data[i + 3] = (uint8_t)new_field;
+		got = net_adjust_checksum32(checksum,old_field,new_field);
+		expected = ~net_get_checksum(0,data,len,1);
+		if(got != expected)
+			fail("adjust32",i,len,expected,got);
+	}
+}
+
+int main(void)
+{
+	unsigned long i;
+	srand(1);
+	for(i = 0 ; i < 100000 ; i++)
+		check_adjust();
+	printf("adjust_test: %lu cases, %lu failures\n",cases,failures);
+	return failures ? 1 : 0;
+}
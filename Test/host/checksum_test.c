@@ -0,0 +1,160 @@
+/*
+ * Host test of net_get_checksum() against a plain word by word fold.
+ *
+ * The AVR kernel of net_sum() cannot run here, net_sum_avr() follows it
+ * instruction by instruction: blocks of at most 128 pairs of words summed
+ * into three 8 bit registers with add/adc. The kernel itself is checked
+ * on the target with CHECKSUM_BENCHMARK.
+ */
+
+#include <net.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE	1600
+
+static uint8_t buffer[BUFFER_SIZE + 4];
+static unsigned long cases;
+static unsigned long failures;
+
+/* RFC 1071, every word added with its carry at once */
+static uint16_t checksum_fold(uint16_t checksum,const uint8_t * data,uint16_t len,uint8_t skip)
+{
+	uint16_t i;
+	for(i = 0 ; i < len ; i += 2)
+	{
+		if(!(skip & 1) && skip + 1 < len && i == skip)
+			continue;
+		uint16_t word = (uint16_t)data[i] << 8;
+		if(i + 1 < len)
+			word |= data[i + 1];
+		checksum += word;
+		if(checksum < word)
+			checksum++;
+	}
+	return checksum;
+}
+
+static uint32_t net_sum_avr(const uint8_t * data,uint16_t len)
+{
+	uint32_t sum = 0;
+	while(len >= 4)
+	{
+		uint8_t pairs = (len >= 512) ? 128 : (len >> 2);
+		uint8_t lo = 0, hi = 0, ext = 0, w;
+		len -= (uint16_t)pairs << 2;
+		do
+		{
+			for(w = 0 ; w < 2 ; w++, data += 2)
+			{
+				/* add lo,t1 ; adc hi,t0 ; adc ext,r1 */
+				uint16_t t = lo + data[1];
+				lo = (uint8_t)t;
+				t = hi + data[0] + (t >> 8);
+				hi = (uint8_t)t;
+				ext += (uint8_t)(t >> 8);
+			}
+		} while(--pairs);
+		sum += ((uint32_t)ext << 16) | ((uint16_t)hi << 8) | lo;
+	}
+	for(; len > 1; len -= 2, data += 2)
+		sum += ((uint16_t)data[0] << 8) | data[1];
+	if(len > 0)
+		sum += (uint16_t)data[0] << 8;
+	return sum;
+}
+
+/* net_get_checksum() as built for the AVR */
+static uint16_t checksum_avr(uint16_t checksum,const uint8_t * data,uint16_t len,uint8_t skip)
+{
+	if(len < 1)
+		return checksum;
+	uint32_t sum = checksum;
+	if(!(skip & 1) && skip + 1 < len)
+	{
+		sum += net_sum_avr(data,skip);
+		sum += net_sum_avr(data + skip + 2,len - skip - 2);
+	}
+	else
+	{
+		sum += net_sum_avr(data,len);
+	}
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)sum;
+}
+
+static void check(const char * pattern,uint16_t checksum,uint16_t offset,uint16_t len,uint8_t skip)
+{
+	const uint8_t * data = buffer + offset;
+	uint16_t expected = checksum_fold(checksum,data,len,skip);
+	uint16_t c = net_get_checksum(checksum,data,len,skip);
+	uint16_t avr = checksum_avr(checksum,data,len,skip);
+	cases++;
+	if(c != expected || avr != expected)
+	{
+		if(failures++ < 10)
+			printf("%s: checksum %04x offset %u len %u skip %u: fold %04x c %04x avr %04x\n",
+				pattern,checksum,offset,len,skip,expected,c,avr);
+	}
+}
+
+static void fill(const char * pattern)
+{
+	uint16_t i;
+	for(i = 0 ; i < sizeof(buffer) ; i++)
+	{
+		if(!strcmp(pattern,"random"))
+			buffer[i] = (uint8_t)rand();
+		else if(!strcmp(pattern,"ones"))
+			buffer[i] = 0xff;
+		else if(!strcmp(pattern,"fffe"))
+			buffer[i] = (i & 1) ? 0xfe : 0xff;
+		else if(!strcmp(pattern,"sparse"))
+			buffer[i] = (rand() & 7) ? 0xff : (uint8_t)rand();
+		else
+			buffer[i] = 0;
+	}
+}
+
+int main(void)
+{
+	static const char * const patterns[] = {"random","ones","fffe","sparse","zeros"};
+	static const uint16_t starts[] = {0x0000,0x0001,0x7fff,0xfffe,0xffff};
+	/* around the 512 byte blocks of the kernel and a full frame */
+	static const uint16_t lengths[] = {511,512,513,515,1023,1024,1025,1480,1499,1500,BUFFER_SIZE};
+	unsigned p, s, i;
+	uint16_t len, offset;
+	srand(1);
+	for(p = 0 ; p < sizeof(patterns) / sizeof(patterns[0]) ; p++)
+	{
+		fill(patterns[p]);
+		for(s = 0 ; s < sizeof(starts) / sizeof(starts[0]) ; s++)
+		{
+			for(offset = 0 ; offset < 4 ; offset++)
+			{
+				for(len = 0 ; len < 300 ; len++)
+				{
+					check(patterns[p],starts[s],offset,len,1);
+					check(patterns[p],starts[s],offset,len,(uint8_t)(len & ~1));
+					check(patterns[p],starts[s],offset,len,16);
+				}
+				for(i = 0 ; i < sizeof(lengths) / sizeof(lengths[0]) ; i++)
+				{
+					check(patterns[p],starts[s],offset,lengths[i],1);
+					check(patterns[p],starts[s],offset,lengths[i],16);
+				}
+			}
+		}
+	}
+	/* random lengths, alignments and contents */
+	for(i = 0 ; i < 20000 ; i++)
+	{
+		fill((i & 1) ? "random" : "sparse");
+		len = (uint16_t)(rand() % (BUFFER_SIZE + 1));
+		check("fuzz",(uint16_t)rand(),(uint16_t)(rand() & 3),len,(uint8_t)rand());
+	}
+	printf("checksum_test: %lu cases, %lu failures\n",cases,failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Host test of the checksums the ENC28J60 DMA computes for the driver,
+ * Enc28j60TxChecksum() and Enc28j60RxChecksum(), against
+ * net_get_checksum(). The driver runs unchanged against the emulated
+ * controller of enc28j60_emu.c, received frames wrap the end of the
+ * receive buffer.
+ */
+
+#include <net.h>
+#include <enc28j60.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "enc28j60_emu.h"
+
+#define FRAME_SIZE	1514
+
+static uint8_t data[FRAME_SIZE];
+static uint8_t read[FRAME_SIZE + 1];
+static unsigned long cases;
+static unsigned long failures;
+
+static void fail(const char * test,uint16_t offset,uint16_t len,uint16_t expected,uint16_t got)
+{
+	if(failures++ < 10)
+		printf("%s: offset %u len %u: expected %04x got %04x\n",test,offset,len,expected,got);
+}
+
+static void fill(uint8_t * buffer,uint16_t len)
+{
+	uint16_t i;
+	/* mostly 0xff to carry often */
+	for(i = 0 ; i < len ; i++)
+		buffer[i] = (rand() & 3) ? 0xff : (uint8_t)rand();
+}
+
+/* the data is put behind the per packet control byte of the transmit slot */
+static void check_tx(uint16_t offset,uint16_t len)
+{
+	uint16_t expected = net_get_checksum(0,data,len,1);
+	uint16_t sum;
+	cases++;
+	memcpy(&enc_emu_memory[TXSTART_INIT + 1 + offset],data,len);
+	sum = Enc28j60TxChecksum(offset,len);
+	if(sum != (uint16_t)~expected)
+		fail("tx checksum",offset,len,~expected,sum);
+}
+
+/* frames received one after the other until they wrap the receive buffer */
+static uint16_t check_rx(void)
+{
+	uint16_t wrapped = 0;
+	unsigned n;
+	for(n = 0 ; n < 64 ; n++)
+	{
+		/* the controller drops frames longer than MAMXFL with the CRC */
+		uint16_t len = 60 + rand() % (MAX_FRAMELEN - 4 - 59);
+		uint16_t start = enc_emu_register(ERXWRPTL) | (enc_emu_register(ERXWRPTH) << 8);
+		unsigned w;
+		if(start + 6 + len > RXSTOP_INIT + 1)
+			wrapped++;
+		fill(data,len);
+		cases++;
+		if(!enc_emu_receive(data,len))
+		{
+			fail("dropped",0,len,len,0);
+			return wrapped;
+		}
+		uint16_t got = Enc28j60PacketReceiveHeader(sizeof(read),14,read);
+		if(got == 0 || memcmp(read,data,14))
+		{
+			fail("receive",0,len,len,got);
+			return wrapped;
+		}
+		for(w = 0 ; w < 8 ; w++)
+		{
+			uint16_t offset = rand() % len;
+			uint16_t size = 1 + ((w == 0) ? len - offset - 1 : rand() % (len - offset));
+			uint16_t expected = net_get_checksum(0,data + offset,size,1);
+			uint16_t sum = Enc28j60RxChecksum(offset,size);
+			cases++;
+			if(sum != (uint16_t)~expected)
+				fail("rx checksum",offset,size,~expected,sum);
+		}
+		Enc28j60PacketFree();
+	}
+	return wrapped;
+}
+
+int main(void)
+{
+	static uint8_t mac[6] = {0x02,0x00,0x00,0x00,0x00,0x01};
+	uint16_t offset, len, wrapped;
+	unsigned i;
+	srand(1);
+	enc_emu_reset();
+	Enc28j60Init(mac);
+	for(offset = 0 ; offset < 4 ; offset++)
+	{
+		for(len = 1 ; len < 300 ; len++)
+		{
+			fill(data,len);
+			check_tx(offset,len);
+		}
+	}
+	for(i = 0 ; i < 200 ; i++)
+	{
+		len = 1 + rand() % (FRAME_SIZE - 17);
+		fill(data,len);
+		check_tx(rand() % 16,len);
+	}
+	wrapped = check_rx();
+	if(wrapped == 0)
+		fail("no frame wrapped",0,0,1,0);
+	printf("dma_test: %lu cases, %u frames wrapped, %lu failures\n",cases,wrapped,failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * ENC28J60 emulated behind the SPI registers, see enc28j60_emu.h.
+ *
+ * A byte is exchanged whenever the driver polls SPSR for SPIF: what was
+ * written to SPDR goes out, the controller's answer is left in SPDR.
+ * The driver polls exactly once per byte, so this follows it byte for
+ * byte. A transaction ends when CS is seen high on the next PORTB access.
+ * DMA and transmission complete at once, the receive filters are not
+ * emulated.
+ */
+
+#include <avr/io.h>
+#include <enc28j60.h>
+#include <string.h>
+#include "enc28j60_emu.h"
+
+#define SLOTS		(4 * 32)
+#define SENT_FRAMES	8
+#define SENT_SIZE	1536
+
+volatile uint8_t SPDR, SPCR, DDRB;
+static volatile uint8_t spsr;
+static volatile uint8_t portb = 1 << PORTB2;
+
+uint8_t enc_emu_memory[ENC_EMU_MEMORY_SIZE];
+static uint8_t regs[SLOTS];
+static uint16_t phy[32];
+
+/* bytes exchanged since CS went low and the opcode of the transaction */
+static uint16_t spi_count;
+static uint8_t spi_op;
+static uint32_t transactions;
+
+static uint8_t sent[SENT_FRAMES][SENT_SIZE];
+static uint16_t sent_length[SENT_FRAMES];
+static uint8_t sent_head;
+static uint8_t sent_count;
+static uint16_t tx_aborts;
+
+/* common registers are in bank 0 */
+static uint8_t slot(uint8_t bank,uint8_t address)
+{
+	address &= ADDR_MASK;
+	return (address >= (EIE & ADDR_MASK)) ? address : (uint8_t)(bank * 32 + address);
+}
+
+#define R(address)	regs[slot(((address) & BANK_MASK) >> 5,(address))]
+
+static uint16_t get16(uint8_t low)
+{
+	return R(low) | (R(low + 1) << 8);
+}
+
+static void set16(uint8_t low,uint16_t value)
+{
+	R(low) = (uint8_t)value;
+	R(low + 1) = (uint8_t)(value >> 8);
+}
+
+/* next address, the receive buffer wraps */
+static uint16_t next_address(uint16_t address)
+{
+	if(address == get16(ERXNDL))
+		return get16(ERXSTL);
+	return (address + 1) & (ENC_EMU_MEMORY_SIZE - 1);
+}
+
+static void soft_reset(void)
+{
+	memset(regs,0,sizeof(regs));
+	set16(ERDPTL,0x05FA);
+	set16(ERXSTL,0x05FA);
+	set16(ERXNDL,0x1FFF);
+	set16(ERXRDPTL,0x05FA);
+	set16(ERXWRPTL,0x05FA);
+	R(ECON2) = ECON2_AUTOINC;
+	R(ESTAT) = ESTAT_CLKRDY;
+	set16(MAMXFLL,0x0600);
+	R(EREVID) = 0x06;
+	memset(phy,0,sizeof(phy));
+	phy[PHSTAT1] = PHSTAT1_LLSTAT;
+	phy[PHSTAT2] = PHSTAT2_LSTAT;
+}
+
+static uint8_t frame_too_long(uint16_t len)
+{
+	return !(R(MACON3) & MACON3_HFRMLEN) && len + 4 > get16(MAMXFLL);
+}
+
+static void dma(void)
+{
+	uint16_t address = get16(EDMASTL);
+	uint16_t end = get16(EDMANDL);
+	if(R(ECON1) & ECON1_CSUMEN)
+	{
+		uint32_t sum = 0;
+		uint16_t n = 0;
+		for(;; address = next_address(address), n++)
+		{
+			sum += (n & 1) ? enc_emu_memory[address] : enc_emu_memory[address] << 8;
+			if(address == end)
+				break;
+		}
+		while(sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		set16(EDMACSL,(uint16_t)~sum);
+	}
+	else
+	{
+		uint16_t dest = get16(EDMADSTL);
+		for(;; address = next_address(address))
+		{
+			enc_emu_memory[dest] = enc_emu_memory[address];
+			dest = (dest + 1) & (ENC_EMU_MEMORY_SIZE - 1);
+			if(address == end)
+				break;
+		}
+	}
+	R(EIR) |= EIR_DMAIF;
+}
+
+/* the frame follows the per packet control byte at ETXST up to ETXND */
+static void transmit(void)
+{
+	uint16_t start = get16(ETXSTL);
+	uint16_t len = get16(ETXNDL) - start;
+	if(frame_too_long(len) || len > SENT_SIZE || sent_count == SENT_FRAMES)
+	{
+		tx_aborts++;
+		R(ESTAT) |= ESTAT_TXABRT;
+		R(EIR) |= EIR_TXERIF;
+		return;
+	}
+	uint8_t * frame = sent[(sent_head + sent_count) % SENT_FRAMES];
+	memcpy(frame,&enc_emu_memory[start + 1],len);
+	/* padded to 60 bytes as set in MACON3 */
+	if(len < 60)
+	{
+		memset(frame + len,0,60 - len);
+		len = 60;
+	}
+	sent_length[(sent_head + sent_count) % SENT_FRAMES] = len;
+	sent_count++;
+	R(EIR) |= EIR_TXIF;
+}
+
+static void write_register(uint8_t address,uint8_t value)
+{
+	uint8_t bank = R(ECON1) & (ECON1_BSEL1 | ECON1_BSEL0);
+	uint8_t i = slot(bank,address);
+	regs[i] = value;
+	if(i == slot(0,ECON1))
+	{
+		if(value & ECON1_DMAST)
+		{
+			dma();
+			regs[i] &= ~ECON1_DMAST;
+		}
+		if(value & ECON1_TXRTS)
+		{
+			transmit();
+			regs[i] &= ~ECON1_TXRTS;
+		}
+	}
+	else if(i == slot(0,ECON2))
+	{
+		if((value & ECON2_PKTDEC) && R(EPKTCNT) > 0 && --R(EPKTCNT) == 0)
+			R(EIR) &= ~EIR_PKTIF;
+		regs[i] &= ~ECON2_PKTDEC;
+	}
+	else if(i == slot(0,ESTAT))
+	{
+		regs[i] |= ESTAT_CLKRDY;
+	}
+	else if(i == slot(0,ERXSTH))
+	{
+		/* writing ERXST moves the write pointer to it */
+		set16(ERXWRPTL,get16(ERXSTL));
+	}
+	else if(i == slot(2,MICMD))
+	{
+		if(value & MICMD_MIIRD)
+			set16(MIRDL,phy[R(MIREGADR) & 0x1F]);
+	}
+	else if(i == slot(2,MIWRH))
+	{
+		phy[R(MIREGADR) & 0x1F] = get16(MIWRL);
+	}
+}
+
+static uint8_t exchange(uint8_t mosi)
+{
+	if(spi_count++ == 0)
+	{
+		transactions++;
+		spi_op = mosi;
+		if(mosi == ENC28J60_SOFT_RESET)
+			soft_reset();
+		return 0;
+	}
+	uint8_t address = spi_op & ADDR_MASK;
+	uint8_t bank = R(ECON1) & (ECON1_BSEL1 | ECON1_BSEL0);
+	if(spi_op == ENC28J60_READ_BUF_MEM)
+	{
+		uint16_t pointer = get16(ERDPTL);
+		uint8_t byte = enc_emu_memory[pointer];
+		set16(ERDPTL,next_address(pointer));
+		return byte;
+	}
+	if(spi_op == ENC28J60_WRITE_BUF_MEM)
+	{
+		uint16_t pointer = get16(EWRPTL);
+		enc_emu_memory[pointer] = mosi;
+		set16(EWRPTL,(pointer + 1) & (ENC_EMU_MEMORY_SIZE - 1));
+		return 0;
+	}
+	switch(spi_op & ~ADDR_MASK)
+	{
+	case ENC28J60_READ_CTRL_REG:
+		/* MAC and MII registers send a dummy byte first, the same will do */
+		return regs[slot(bank,address)];
+	case ENC28J60_WRITE_CTRL_REG:
+		if(spi_count == 2)
+			write_register(address,mosi);
+		return 0;
+	case ENC28J60_BIT_FIELD_SET:
+		if(spi_count == 2)
+			write_register(address,regs[slot(bank,address)] | mosi);
+		return 0;
+	case ENC28J60_BIT_FIELD_CLR:
+		if(spi_count == 2)
+			write_register(address,regs[slot(bank,address)] & ~mosi);
+		return 0;
+	}
+	return 0;
+}
+
+volatile uint8_t * enc_emu_portb(void)
+{
+	if(portb & (1 << PORTB2))
+		spi_count = 0;
+	return &portb;
+}
+
+volatile uint8_t * enc_emu_spsr(void)
+{
+	if(!(portb & (1 << PORTB2)))
+		SPDR = exchange(SPDR);
+	spsr |= 1 << SPIF;
+	return &spsr;
+}
+
+void enc_emu_reset(void)
+{
+	memset(enc_emu_memory,0,sizeof(enc_emu_memory));
+	soft_reset();
+	portb = 1 << PORTB2;
+	spi_count = 0;
+	transactions = 0;
+	sent_head = 0;
+	sent_count = 0;
+	tx_aborts = 0;
+}
+
+uint8_t enc_emu_register(uint8_t address)
+{
+	return R(address);
+}
+
+uint8_t enc_emu_receive(const uint8_t * frame,uint16_t len)
+{
+	if(!(R(ECON1) & ECON1_RXEN) || frame_too_long(len))
+		return 0;
+	uint16_t pointer = get16(ERXWRPTL);
+	uint16_t count = len + 4;
+	/* frames start on even addresses */
+	uint16_t next = pointer;
+	uint16_t i;
+	for(i = 0 ; i < 6 + count + (count & 1) ; i++)
+		next = next_address(next);
+	uint8_t header[6] = {next & 0xFF,next >> 8,count & 0xFF,count >> 8,0x80,0x00};
+	for(i = 0 ; i < 6 + count ; i++, pointer = next_address(pointer))
+	{
+		if(i < 6)
+			enc_emu_memory[pointer] = header[i];
+		else if(i < 6 + len)
+			enc_emu_memory[pointer] = frame[i - 6];
+		else
+			enc_emu_memory[pointer] = 0;
+	}
+	set16(ERXWRPTL,next);
+	R(EPKTCNT)++;
+	R(EIR) |= EIR_PKTIF;
+	return 1;
+}
+
+uint16_t enc_emu_sent(uint8_t * frame,uint16_t size)
+{
+	if(sent_count == 0)
+		return 0;
+	uint16_t len = sent_length[sent_head];
+	memcpy(frame,sent[sent_head],(len < size) ? len : size);
+	sent_head = (sent_head + 1) % SENT_FRAMES;
+	sent_count--;
+	return len;
+}
+
+uint16_t enc_emu_tx_aborts(void)
+{
+	return tx_aborts;
+}
+
+uint32_t enc_emu_transactions(void)
+{
+	return transactions;
+}
@@ -0,0 +1,30 @@
+/*
+ * ENC28J60 emulated behind the SPI registers of stub/avr/io.h, enough of
+ * it for the driver in ENC28J60C: control registers and banks, buffer
+ * memory with the auto incremented pointers, DMA copy and checksum, the
+ * MII registers, receive and transmit.
+ */
+
+#ifndef _ENC28J60_EMU_H
+#define _ENC28J60_EMU_H
+
+#include <stdint.h>
+
+#define ENC_EMU_MEMORY_SIZE	0x2000
+
+extern uint8_t enc_emu_memory[ENC_EMU_MEMORY_SIZE];
+
+/* power on state, the link is up */
+void enc_emu_reset(void);
+/* register as addressed by the driver, bank bits included */
+uint8_t enc_emu_register(uint8_t address);
+/* a frame without CRC arrives, 0 if the controller dropped it */
+uint8_t enc_emu_receive(const uint8_t * frame,uint16_t len);
+/* takes the oldest frame sent, returns its length without CRC, 0 if none */
+uint16_t enc_emu_sent(uint8_t * frame,uint16_t size);
+/* frames given up as too long since the reset */
+uint16_t enc_emu_tx_aborts(void);
+/* SPI transactions, CS cycles with at least one byte, since the reset */
+uint32_t enc_emu_transactions(void);
+
+#endif
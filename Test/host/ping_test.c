@@ -0,0 +1,147 @@
+/*
+ * Host test of echo requests up to the full ethernet MTU. The frames go
+ * through the unchanged driver, ethernet, ip and icmp layers on the
+ * emulated controller of enc28j60_emu.c, the replies are checked as
+ * they left the controller. The SPI transactions spent on an echo, the
+ * request received and the reply sent, are reported.
+ */
+
+#include <net.h>
+#include <enc28j60.h>
+#include <ethernet.h>
+#include <ip.h>
+#include <tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "enc28j60_emu.h"
+
+#define FRAME_SIZE	1514
+
+static const ethernet_address mac = {0x02,0x00,0x00,0x00,0x00,0x01};
+static const ethernet_address peer_mac = {0x02,0x00,0x00,0x00,0x00,0x02};
+static const ip_address addr = {192,168,0,1};
+static const ip_address netmask = {255,255,255,0};
+static const ip_address peer = {192,168,0,2};
+
+static uint8_t request[FRAME_SIZE];
+static uint8_t reply[FRAME_SIZE];
+static unsigned long cases;
+static unsigned long failures;
+static unsigned long echoes;
+static uint32_t transactions;
+
+/* the tcp layer and the debug output are not part of this test */
+uint8_t tcp_handle_packet(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
+{
+	return 0;
+}
+
+void tcp_link_down(void)
+{
+}
+
+void uart_puts_p(const char * s)
+{
+}
+
+static void fail(const char * test,uint16_t len)
+{
+	if(failures++ < 10)
+		printf("%s: frame of %u bytes\n",test,len);
+}
+
+/* echo request of len bytes with the ethernet header */
+static void build_request(uint16_t len)
+{
+	uint8_t * ip = request + NET_HEADER_SIZE_ETHERNET;
+	uint8_t * icmp = ip + NET_HEADER_SIZE_IP;
+	uint16_t ip_len = len - NET_HEADER_SIZE_ETHERNET;
+	uint16_t i, checksum;
+	memcpy(request,mac,6);
+	memcpy(request + 6,peer_mac,6);
+	request[12] = 0x08;
+	request[13] = 0x00;
+	memset(ip,0,NET_HEADER_SIZE_IP);
+	ip[0] = 0x45;
+	ip[2] = ip_len >> 8;
+	ip[3] = (uint8_t)ip_len;
+	ip[8] = 64;
+	ip[9] = 1;
+	memcpy(ip + 12,peer,4);
+	memcpy(ip + 16,addr,4);
+	checksum = ~net_get_checksum(0,ip,NET_HEADER_SIZE_IP,1);
+	ip[10] = checksum >> 8;
+	ip[11] = (uint8_t)checksum;
+	icmp[0] = 8;
+	icmp[1] = 0;
+	icmp[2] = icmp[3] = 0;
+	for(i = 4 ; i < ip_len - NET_HEADER_SIZE_IP ; i++)
+		icmp[i] = (uint8_t)rand();
+	checksum = ~net_get_checksum(0,icmp,ip_len - NET_HEADER_SIZE_IP,1);
+	icmp[2] = checksum >> 8;
+	icmp[3] = (uint8_t)checksum;
+}
+
+static void check_ping(uint16_t len)
+{
+	uint16_t ip_len = len - NET_HEADER_SIZE_ETHERNET;
+	const uint8_t * ip = reply + NET_HEADER_SIZE_ETHERNET;
+	const uint8_t * icmp = ip + NET_HEADER_SIZE_IP;
+	uint16_t sent;
+	uint32_t start;
+	cases++;
+	build_request(len);
+	if(!enc_emu_receive(request,len))
+	{
+		fail("dropped by the controller",len);
+		return;
+	}
+	start = enc_emu_transactions();
+	while(handle_ethernet_packet());
+	transactions += enc_emu_transactions() - start;
+	echoes++;
+	sent = enc_emu_sent(reply,sizeof(reply));
+	/* short replies are padded */
+	if(sent != ((len < 60) ? 60 : len))
+	{
+		fail(sent ? "reply length" : "no reply",len);
+		return;
+	}
+	if(memcmp(reply,peer_mac,6) || memcmp(reply + 6,mac,6) || reply[12] != 0x08 || reply[13] != 0x00)
+		fail("ethernet header",len);
+	if(((ip[2] << 8) | ip[3]) != ip_len || ip[9] != 1 || memcmp(ip + 12,addr,4) || memcmp(ip + 16,peer,4))
+		fail("ip header",len);
+	if(net_get_checksum(0,ip,NET_HEADER_SIZE_IP,1) != 0xffff)
+		fail("ip checksum",len);
+	if(icmp[0] != 0 || icmp[1] != 0)
+		fail("icmp type",len);
+	if(net_get_checksum(0,icmp,ip_len - NET_HEADER_SIZE_IP,1) != 0xffff)
+		fail("icmp checksum",len);
+	/* identifier, sequence number and data */
+	if(memcmp(icmp + 4,request + NET_HEADER_SIZE_ETHERNET + NET_HEADER_SIZE_IP + 4,ip_len - NET_HEADER_SIZE_IP - 4))
+		fail("icmp data",len);
+}
+
+int main(void)
+{
+	/* around the end of ethernet_buffer and up to the MTU */
+	static const uint16_t lengths[] = {42,60,98,255,256,257,1000,1001,1513,FRAME_SIZE};
+	unsigned i;
+	srand(1);
+	enc_emu_reset();
+	Enc28j60Init((uint8_t*)mac);
+	ethernet_init(&mac);
+	ip_init(&addr,&netmask,&addr);
+	if(!ethernet_link_up())
+		fail("link down",0);
+	for(i = 0 ; i < sizeof(lengths) / sizeof(lengths[0]) ; i++)
+		check_ping(lengths[i]);
+	for(i = 0 ; i < 200 ; i++)
+		check_ping(42 + rand() % (FRAME_SIZE - 41));
+	if(enc_emu_tx_aborts())
+		fail("transmissions aborted",0);
+	printf("ping_test: %lu cases, %lu SPI transactions per echo, %lu failures\n",
+		cases,echoes ? (unsigned long)(transactions / echoes) : 0,failures);
+	return failures ? 1 : 0;
+}
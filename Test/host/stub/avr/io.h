@@ -0,0 +1,35 @@
+/*
+ * Just enough of avr/io.h to build the driver and the stack on the host.
+ * Every poll of SPSR shifts SPDR out to the emulated ENC28J60 and its
+ * answer in, every access to PORTB lets it see CS, see enc28j60_emu.c.
+ */
+
+#ifndef _STUB_AVR_IO_H
+#define _STUB_AVR_IO_H
+
+#include <stdint.h>
+#include <inttypes.h>
+
+extern volatile uint8_t SPDR, SPCR, DDRB;
+extern volatile uint8_t * enc_emu_spsr(void);
+extern volatile uint8_t * enc_emu_portb(void);
+/* timer 1, set by the test */
+extern volatile uint16_t TCNT1, OCR1A;
+
+/* ATmega328 */
+#define RAMEND		0x8FF
+
+#define SPSR		(*enc_emu_spsr())
+#define PORTB		(*enc_emu_portb())
+
+#define SPIF		7
+#define SPE		6
+#define MSTR		4
+#define SPI2X		0
+
+#define PORTB2		2
+#define PORTB3		3
+#define PORTB4		4
+#define PORTB5		5
+
+#endif
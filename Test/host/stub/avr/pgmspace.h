@@ -0,0 +1,17 @@
+#ifndef _STUB_AVR_PGMSPACE_H
+#define _STUB_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define PROGMEM
+#define PSTR(s)			(s)
+typedef const char * PGM_P;
+#define pgm_read_byte(p)	(*(const uint8_t*)(p))
+#define pgm_read_word(p)	(*(const uint16_t*)(p))
+#define memcpy_P		memcpy
+#define strlen_P		strlen
+#define strncasecmp_P		strncasecmp
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _STUB_UTIL_ATOMIC_H
+#define _STUB_UTIL_ATOMIC_H
+
+/* the host tests call timer_tick() themselves, nothing interrupts */
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type)	for(int _atomic_once = 1 ; _atomic_once ; _atomic_once = 0)
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Host test of the sums the driver folds while it shifts the buffer
+ * memory in and out, Enc28j60ReadBufferSum(), Enc28j60WriteBufferSum()
+ * and Enc28j60PacketReadSum(), against net_get_checksum(), and of
+ * Enc28j60SkipBuffer(). The driver runs unchanged against the emulated
+ * controller of enc28j60_emu.c.
+ */
+
+#include <net.h>
+#include <enc28j60.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "enc28j60_emu.h"
+
+#define FRAME_SIZE	1514
+
+static uint8_t data[FRAME_SIZE];
+static uint8_t read[FRAME_SIZE + 1];
+static unsigned long cases;
+static unsigned long failures;
+
+static void fail(const char * test,uint16_t offset,uint16_t len,uint16_t expected,uint16_t got)
+{
+	if(failures++ < 10)
+		printf("%s: offset %u len %u: expected %04x got %04x\n",test,offset,len,expected,got);
+}
+
+static void fill(uint8_t * buffer,uint16_t len)
+{
+	uint16_t i;
+	/* mostly 0xff to carry often */
+	for(i = 0 ; i < len ; i++)
+		buffer[i] = (rand() & 3) ? 0xff : (uint8_t)rand();
+}
+
+/* written into the transmit slot and read back over SPI */
+static void check_tx(uint16_t offset,uint16_t len)
+{
+	uint16_t expected = net_get_checksum(0,data,len,1);
+	uint16_t sum;
+	cases++;
+	Enc28j60TxSeek(offset);
+	sum = Enc28j60WriteBufferSum(len,data);
+	if(sum != expected)
+		fail("write sum",offset,len,expected,sum);
+	if(memcmp(&enc_emu_memory[TXSTART_INIT + 1 + offset],data,len))
+		fail("write data",offset,len,0,0);
+	memset(read,0x55,sizeof(read));
+	Enc28j60Write16(ERDPTL,TXSTART_INIT + 1 + offset);
+	sum = Enc28j60ReadBufferSum(len,read);
+	if(sum != expected)
+		fail("read sum",offset,len,expected,sum);
+	if(memcmp(read,data,len) || read[len] != '\0')
+		fail("read data",offset,len,0,0);
+	/* skipping moves the read pointer as far as reading */
+	Enc28j60Write16(ERDPTL,TXSTART_INIT + 1 + offset);
+	Enc28j60SkipBuffer(len);
+	uint16_t pointer = enc_emu_register(ERDPTL) | (enc_emu_register(ERDPTH) << 8);
+	if(pointer != TXSTART_INIT + 1 + offset + len)
+		fail("skip",offset,len,TXSTART_INIT + 1 + offset + len,pointer);
+}
+
+/* frames received one after the other until they wrap the receive buffer */
+static uint16_t check_rx(void)
+{
+	uint16_t wrapped = 0;
+	unsigned n;
+	for(n = 0 ; n < 64 ; n++)
+	{
+		/* the controller drops frames longer than MAMXFL with the CRC */
+		uint16_t len = 60 + rand() % (MAX_FRAMELEN - 4 - 59);
+		uint16_t start = enc_emu_register(ERXWRPTL) | (enc_emu_register(ERXWRPTH) << 8);
+		unsigned w;
+		if(start + 6 + len > RXSTOP_INIT + 1)
+			wrapped++;
+		fill(data,len);
+		cases++;
+		if(!enc_emu_receive(data,len))
+		{
+			fail("dropped",0,len,len,0);
+			return wrapped;
+		}
+		uint16_t got = Enc28j60PacketReceiveHeader(sizeof(read),14,read);
+		if(got != len || memcmp(read,data,14))
+		{
+			fail("receive",0,len,len,got);
+			return wrapped;
+		}
+		for(w = 0 ; w < 8 ; w++)
+		{
+			uint16_t offset = rand() % len;
+			uint16_t size = (w == 0) ? len - offset : rand() % (len - offset + 1);
+			uint16_t expected = net_get_checksum(0,data + offset,size,1);
+			uint16_t sum = Enc28j60PacketReadSum(offset,size,read);
+			cases++;
+			if(sum != expected)
+				fail("packet read sum",offset,size,expected,sum);
+			if(memcmp(read,data + offset,size))
+				fail("packet read data",offset,size,0,0);
+		}
+		Enc28j60PacketFree();
+	}
+	return wrapped;
+}
+
+int main(void)
+{
+	static uint8_t mac[6] = {0x02,0x00,0x00,0x00,0x00,0x01};
+	uint16_t offset, len, wrapped;
+	unsigned i;
+	srand(1);
+	enc_emu_reset();
+	Enc28j60Init(mac);
+	for(offset = 0 ; offset < 4 ; offset++)
+	{
+		for(len = 0 ; len < 300 ; len++)
+		{
+			fill(data,len);
+			check_tx(offset,len);
+		}
+	}
+	for(i = 0 ; i < 200 ; i++)
+	{
+		len = rand() % (FRAME_SIZE - 16);
+		fill(data,len);
+		check_tx(rand() % 16,len);
+	}
+	wrapped = check_rx();
+	if(wrapped == 0)
+		fail("no frame wrapped",0,0,1,0);
+	printf("sum_test: %lu cases, %u frames wrapped, %lu failures\n",cases,wrapped,failures);
+	return failures ? 1 : 0;
+}
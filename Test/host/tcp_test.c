@@ -0,0 +1,459 @@
+/*
+ * Host test of the TCP layer. Segments go through the unchanged driver,
+ * ethernet, ip and tcp layers on the emulated controller of
+ * enc28j60_emu.c, the answers are checked as they left the controller.
+ * The test stands in for the timer interrupt and calls timer_tick()
+ * itself, tcp_poll() runs when the main loop would.
+ *
+ * Covered: the handshake, a request and the close; TIME_WAIT matching
+ * the full 4-tuple and its expiry; SYN cookies over the counter window;
+ * a timeout that fired before its timer was armed again.
+ */
+
+#include <net.h>
+#include <enc28j60.h>
+#include <ethernet.h>
+#include <ip.h>
+#include <arp.h>
+#include <tcp.h>
+#include <timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "enc28j60_emu.h"
+
+#define FRAME_SIZE	1514
+#define PORT		80
+
+#define FIN	0x01
+#define SYN	0x02
+#define RST	0x04
+#define PSH	0x08
+#define ACK	0x10
+
+/* ticks of a cookie counter period, see TCP_COOKIE_COUNTER */
+#define COOKIE_PERIOD	2048
+
+volatile uint16_t TCNT1, OCR1A;
+
+static const ethernet_address mac = {0x02,0x00,0x00,0x00,0x00,0x01};
+static const ethernet_address peer_mac = {0x02,0x00,0x00,0x00,0x00,0x02};
+static const ip_address addr = {192,168,0,1};
+static const ip_address netmask = {255,255,255,0};
+static const ip_address peer = {192,168,0,2};
+static const ip_address other_peer = {192,168,0,3};
+
+static const char reply_text[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+static uint8_t frame[FRAME_SIZE];
+static unsigned long cases;
+static unsigned long failures;
+
+/* events seen by the application */
+static unsigned established;
+static unsigned closed;
+static unsigned idle;
+
+/* a segment as it left the controller */
+struct segment
+{
+	uint16_t port_source;
+	uint16_t port_destination;
+	uint32_t seq;
+	uint32_t ack;
+	uint8_t flags;
+	uint16_t data_length;
+	char data[FRAME_SIZE];
+};
+
+static void fail(const char * test,const char * what)
+{
+	if(failures++ < 10)
+		printf("%s: %s\n",test,what);
+}
+
+void uart_puts(const char * s)
+{
+}
+
+void uart_puts_p(const char * s)
+{
+}
+
+/* Replies to every request, a request starting with "close" closes */
+static void callback(tcp_socket_t socket,enum tcp_event event)
+{
+	switch(event)
+	{
+	case tcp_event_connection_established:
+		established++;
+		break;
+	case tcp_event_data_received:
+	{
+		uint16_t len;
+		const uint8_t * data = tcp_read(socket,&len);
+		if(len == 0)
+			break;
+		tcp_write(socket,(const uint8_t*)reply_text);
+		if(len >= 5 && !memcmp(data,"close",5))
+			tcp_close(socket);
+		break;
+	}
+	case tcp_event_data_send:
+	case tcp_event_data_regenerate:
+		tcp_write(socket,(const uint8_t*)reply_text);
+		break;
+	case tcp_event_connection_closed:
+	case tcp_event_timeout:
+	case tcp_event_reset:
+		closed++;
+		break;
+	case tcp_event_connection_idle:
+		idle++;
+		break;
+	default:
+		break;
+	}
+}
+
+static uint32_t get32(const uint8_t * p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t * p,uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = (uint8_t)(value >> 16);
+	p[2] = (uint8_t)(value >> 8);
+	p[3] = (uint8_t)value;
+}
+
+/* checksum of the TCP segment with the pseudo header */
+static uint16_t tcp_sum(const uint8_t * ip,const uint8_t * tcp,uint16_t length)
+{
+	uint8_t pseudo[12];
+	memcpy(pseudo,ip + 12,8);
+	pseudo[8] = 0;
+	pseudo[9] = 6;
+	pseudo[10] = length >> 8;
+	pseudo[11] = (uint8_t)length;
+	return net_get_checksum(net_get_checksum(0,pseudo,sizeof(pseudo),1),tcp,length,1);
+}
+
+/* A segment from the peer arrives and is handled at once */
+static void receive(const ip_address * from,uint16_t port,uint32_t seq,uint32_t ack,uint8_t flags,const char * data)
+{
+	uint8_t * ip = frame + NET_HEADER_SIZE_ETHERNET;
+	uint8_t * tcp = ip + NET_HEADER_SIZE_IP;
+	/* a SYN carries the MSS option */
+	uint16_t header = (flags & SYN) ? 24 : 20;
+	uint16_t data_length = data ? strlen(data) : 0;
+	uint16_t length = header + data_length;
+	uint16_t checksum;
+	memcpy(frame,mac,6);
+	memcpy(frame + 6,peer_mac,6);
+	frame[12] = 0x08;
+	frame[13] = 0x00;
+	memset(ip,0,NET_HEADER_SIZE_IP);
+	ip[0] = 0x45;
+	ip[2] = (NET_HEADER_SIZE_IP + length) >> 8;
+	ip[3] = (uint8_t)(NET_HEADER_SIZE_IP + length);
+	ip[8] = 64;
+	ip[9] = 6;
+	memcpy(ip + 12,from,4);
+	memcpy(ip + 16,addr,4);
+	checksum = ~net_get_checksum(0,ip,NET_HEADER_SIZE_IP,1);
+	ip[10] = checksum >> 8;
+	ip[11] = (uint8_t)checksum;
+	memset(tcp,0,header);
+	tcp[0] = port >> 8;
+	tcp[1] = (uint8_t)port;
+	tcp[2] = PORT >> 8;
+	tcp[3] = (uint8_t)PORT;
+	put32(tcp + 4,seq);
+	put32(tcp + 8,ack);
+	tcp[12] = (header / 4) << 4;
+	tcp[13] = flags;
+	tcp[14] = 0x40;
+	if(flags & SYN)
+	{
+		tcp[20] = 2;
+		tcp[21] = 4;
+		tcp[22] = 1460 >> 8;
+		tcp[23] = 1460 & 0xff;
+	}
+	memcpy(tcp + header,data,data_length);
+	checksum = ~tcp_sum(ip,tcp,length);
+	tcp[16] = checksum >> 8;
+	tcp[17] = (uint8_t)checksum;
+	if(!enc_emu_receive(frame,NET_HEADER_SIZE_ETHERNET + NET_HEADER_SIZE_IP + length))
+		fail("receive","dropped by the controller");
+	while(handle_ethernet_packet());
+}
+
+/* Takes the oldest segment sent, 0 if there is none */
+static uint8_t sent(struct segment * segment)
+{
+	uint16_t len = enc_emu_sent(frame,sizeof(frame));
+	const uint8_t * ip = frame + NET_HEADER_SIZE_ETHERNET;
+	const uint8_t * tcp = ip + NET_HEADER_SIZE_IP;
+	if(len == 0)
+		return 0;
+	memset(segment,0,sizeof(*segment));
+	if(frame[12] != 0x08 || frame[13] != 0x00 || ip[9] != 6)
+	{
+		fail("sent","not a TCP segment");
+		return 1;
+	}
+	uint16_t length = ((ip[2] << 8) | ip[3]) - NET_HEADER_SIZE_IP;
+	uint16_t header = (tcp[12] >> 4) * 4;
+	if(tcp_sum(ip,tcp,length) != 0xffff)
+		fail("sent","TCP checksum");
+	segment->port_source = (tcp[0] << 8) | tcp[1];
+	segment->port_destination = (tcp[2] << 8) | tcp[3];
+	segment->seq = get32(tcp + 4);
+	segment->ack = get32(tcp + 8);
+	segment->flags = tcp[13];
+	segment->data_length = length - header;
+	memcpy(segment->data,tcp + header,segment->data_length);
+	return 1;
+}
+
+/* Exactly one segment with these flags was sent, the others are dropped */
+static uint8_t expect(const char * test,struct segment * segment,uint8_t flags)
+{
+	struct segment extra;
+	cases++;
+	if(!sent(segment))
+	{
+		fail(test,"nothing sent");
+		return 0;
+	}
+	if(segment->flags != flags)
+	{
+		char buffer[64];
+		sprintf(buffer,"flags %02x instead of %02x",segment->flags,flags);
+		fail(test,buffer);
+		return 0;
+	}
+	if(sent(&extra))
+	{
+		fail(test,"more than one segment sent");
+		while(sent(&extra));
+	}
+	return 1;
+}
+
+static void expect_nothing(const char * test)
+{
+	struct segment segment;
+	cases++;
+	if(sent(&segment))
+	{
+		fail(test,"unexpected segment");
+		while(sent(&segment));
+	}
+}
+
+/* Time passes, the main loop polls after every tick and anything sent
+   meanwhile is dropped */
+static void advance(uint32_t ticks)
+{
+	struct segment segment;
+	while(ticks--)
+	{
+		TCNT1 += 997;
+		timer_tick();
+		tcp_poll();
+		while(sent(&segment));
+	}
+}
+
+/* Until every connection and TIME_WAIT entry is gone */
+static void settle(void)
+{
+	advance((TCP_TIMEOUT_TIME_WAIT + 60000UL) / TIMER_MS_PER_TICK);
+}
+
+/* Opens a connection from port, returns the ISN the stack chose */
+static uint8_t connect_peer(const char * test,const ip_address * from,uint16_t port,uint32_t isn,uint32_t * iss)
+{
+	struct segment segment;
+	unsigned before = established;
+	receive(from,port,isn,0,SYN,0);
+	if(!expect(test,&segment,SYN | ACK))
+		return 0;
+	if(segment.ack != isn + 1 || segment.port_destination != port)
+		fail(test,"SYN, ACK does not match the SYN");
+	*iss = segment.seq;
+	receive(from,port,isn + 1,*iss + 1,ACK,0);
+	expect_nothing(test);
+	if(established != before + 1)
+	{
+		fail(test,"not established");
+		return 0;
+	}
+	return 1;
+}
+
+/* Handshake, a request answered with the reply and FIN, the peer's FIN */
+static void check_close(void)
+{
+	static const char test[] = "close";
+	static const char request[] = "close please";
+	struct segment segment;
+	uint32_t iss;
+	uint32_t seq = 1000;
+	unsigned closed_before = closed;
+	if(!connect_peer(test,&peer,40000,seq - 1,&iss))
+		return;
+	receive(&peer,40000,seq,iss + 1,ACK | PSH,request);
+	if(!expect(test,&segment,ACK | PSH | FIN))
+		return;
+	if(segment.seq != iss + 1 || segment.ack != seq + strlen(request))
+		fail(test,"reply sequence numbers");
+	if(segment.data_length != strlen(reply_text) || memcmp(segment.data,reply_text,segment.data_length))
+		fail(test,"reply data");
+	seq += strlen(request);
+	/* the peer acknowledges the reply and our FIN and closes */
+	receive(&peer,40000,seq,iss + 1 + strlen(reply_text) + 1,ACK | FIN,0);
+	if(expect(test,&segment,ACK) && segment.ack != seq + 1)
+		fail(test,"FIN not acknowledged");
+	cases++;
+	if(closed != closed_before + 1)
+		fail(test,"connection not closed");
+}
+
+/* The connection of check_close() waits in TIME_WAIT */
+static void check_time_wait(void)
+{
+	static const char test[] = "time wait";
+	struct segment segment;
+	uint32_t seq = 1000 + strlen("close please");
+	/* our ACK of the FIN got lost, the peer sends the FIN again */
+	receive(&peer,40000,seq,0,ACK | FIN,0);
+	if(expect(test,&segment,ACK) && segment.ack != seq + 1)
+		fail(test,"FIN not acknowledged again");
+	/* the same FIN from another port or another host belongs to no
+	   connection */
+	receive(&peer,40001,seq,0,ACK | FIN,0);
+	expect(test,&segment,RST);
+	receive(&other_peer,40000,seq,0,ACK | FIN,0);
+	expect(test,&segment,RST);
+	/* the entry expires */
+	advance(TCP_TIMEOUT_TIME_WAIT / TIMER_MS_PER_TICK + 1);
+	receive(&peer,40000,seq,0,ACK | FIN,0);
+	expect(test,&segment,RST);
+}
+
+/* A cookie sent while the backlog is full, the ACK answering it comes
+   back after ticks */
+static void check_cookie(uint16_t port,uint32_t ticks,uint8_t forge,uint8_t accepted)
+{
+	static const char test[] = "cookie";
+	struct segment segment;
+	uint32_t isn = 5000;
+	unsigned before;
+	unsigned i;
+	/* fill the backlog, the SYN, ACKs are not answered */
+	for(i = 0 ; i < TCP_SYN_BACKLOG ; i++)
+	{
+		receive(&peer,port + 1 + i,isn,0,SYN,0);
+		expect(test,&segment,SYN | ACK);
+	}
+	receive(&peer,port,isn,0,SYN,0);
+	if(!expect(test,&segment,SYN | ACK))
+		return;
+	if(segment.ack != isn + 1)
+		fail(test,"cookie SYN, ACK does not match the SYN");
+	advance(ticks);
+	before = established;
+	receive(&peer,port,isn + 1,segment.seq + 1 + forge,ACK,0);
+	cases++;
+	if(accepted)
+	{
+		if(established != before + 1)
+			fail(test,"valid cookie refused");
+		expect_nothing(test);
+	}
+	else
+	{
+		if(established != before)
+			fail(test,"invalid cookie accepted");
+		expect(test,&segment,RST);
+	}
+	settle();
+}
+
+/* The idle timeout fires, a request arrives and arms the timer again
+   before the main loop polls. The stale expiry must not retransmit. */
+static void check_stale_expiry(void)
+{
+	static const char test[] = "stale expiry";
+	static const char request[] = "keep alive";
+	struct segment segment;
+	uint32_t iss;
+	uint32_t seq = 7000;
+	unsigned idle_before = idle;
+	if(!connect_peer(test,&peer,42000,seq - 1,&iss))
+		return;
+	/* no tcp_poll() after the timer interrupt */
+	uint32_t ticks = TCP_TIMEOUT_IDLE / TIMER_MS_PER_TICK + 1;
+	while(ticks--)
+		timer_tick();
+	receive(&peer,42000,seq,iss + 1,ACK | PSH,request);
+	if(!expect(test,&segment,ACK | PSH))
+		return;
+	tcp_poll();
+	expect_nothing(test);
+	cases++;
+	if(idle != idle_before)
+		fail(test,"connection closed as idle");
+	/* the peer acknowledges the reply and closes */
+	receive(&peer,42000,seq + strlen(request),iss + 1 + strlen(reply_text),ACK | FIN,0);
+	settle();
+}
+
+int main(void)
+{
+	tcp_socket_t listener;
+	uint32_t now;
+	srand(1);
+	enc_emu_reset();
+	Enc28j60Init((uint8_t*)mac);
+	timer_init();
+	ethernet_init(&mac);
+	ip_init(&addr,&netmask,&addr);
+	arp_init();
+	tcp_init();
+	arp_table_insert(&peer,&peer_mac);
+	arp_table_insert(&other_peer,&peer_mac);
+	listener = tcp_socket_alloc(callback);
+	if(listener < 0 || !tcp_listen(listener,PORT))
+		fail("listen","no listening socket");
+
+	check_close();
+	check_time_wait();
+	settle();
+
+	/* a cookie is valid in its counter period and the next one */
+	now = timer_get_ticks();
+	advance(COOKIE_PERIOD - now % COOKIE_PERIOD + 10);
+	check_cookie(43000,0,0,1);
+	now = timer_get_ticks();
+	advance(COOKIE_PERIOD - now % COOKIE_PERIOD - 20);
+	check_cookie(43100,40,0,1);
+	now = timer_get_ticks();
+	advance(COOKIE_PERIOD - now % COOKIE_PERIOD + 10);
+	check_cookie(43200,COOKIE_PERIOD + 100,0,1);
+	check_cookie(43300,2 * COOKIE_PERIOD + 100,0,0);
+	check_cookie(43400,0,1,0);
+
+	check_stale_expiry();
+
+	if(enc_emu_tx_aborts())
+		fail("transmit","transmissions aborted");
+	printf("tcp_test: %lu cases, %lu failures\n",cases,failures);
+	return failures ? 1 : 0;
+}
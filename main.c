@@ -4,6 +4,7 @@
 #include <util/delay.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <util/atomic.h>
 #include <string.h>
 #include <stdio.h>
 #include <lowlevelinit.h>
@@ -46,9 +47,83 @@ Maximum startup time.
 static void watchdog_init(void);
 static void httpd_socket_callback(tcp_socket_t socket,enum tcp_event event);
 static uint8_t httpd_start(void);
+static void httpd_send_reply(tcp_socket_t socket);
+static void httpd_send_header(tcp_socket_t socket, PGM_P content_type, uint16_t length);
+#if COLLECTOR_ENABLED
+static void collector_poll(void);
+static void collector_socket_callback(tcp_socket_t socket,enum tcp_event event);
+#endif
+static const char* httpd_request_find(const char* msg, uint16_t len, PGM_P text);
+#if SPI_BENCHMARK
+static void spi_benchmark(void);
+#endif
+#if CHECKSUM_BENCHMARK
+static void checksum_benchmark(void);
+#endif
+#if SPI_COUNT_REPORT_MS
+static void spi_count_report(void);
+#endif
+
+/*
+  A request may arrive in several segments, the reply is sent once
+  the headers and the body are complete.
+*/
+enum httpd_receive
+{
+  httpd_receive_idle = 0,
+  httpd_receive_header,
+  httpd_receive_body
+};
+
+/*
+  Replies are not buffered, the TCP stack asks for the reply again
+  for every segment it sends. What to send is kept per connection.
+*/
+enum httpd_reply
+{
+  httpd_reply_none = 0,
+  httpd_reply_temperature,
+  httpd_reply_ok,
+  httpd_reply_page
+};
+
+struct httpd_connection
+{
+  uint8_t receive;
+  /*Characters of the blank line ending the headers seen so far*/
+  uint8_t header_end;
+  /*Body bytes still to come*/
+  uint16_t body;
+  uint8_t reply;
+  /*Temperature when the request came in, keeps all segments consistent*/
+  char temperature[8];
+  /*Close the connection after the reply instead of keeping it alive*/
+  uint8_t close;
+};
+
+static struct httpd_connection httpd_connections[TCP_MAX_SOCKETS];
+/*The static parts of the page are kept in the ethernet controller*/
+static struct tcp_cache httpd_page_1;
+static struct tcp_cache httpd_page_2;
+static uint8_t httpd_receive(struct httpd_connection* connection, const char* msg, uint16_t len);
+
+#if COLLECTOR_ENABLED
+/*
+  Samples are pushed on one connection kept open to the collector,
+  it is opened again after COLLECTOR_INTERVAL_MS when lost.
+*/
+static const ip_address collector_ip = COLLECTOR_IP;
+static tcp_socket_t collector_socket = -1;
+static uint8_t collector_connected;
+/*A sample is kept until acknowledged, it may have to be written again*/
+static uint8_t collector_pending;
+static char collector_sample[8];
+static uint16_t collector_ticks;
+#endif
 
 static const ethernet_address my_mac = MAC_ADDRESS;
-static uint8_t int28j60 = 0;
+/*set until the main loop has serviced the controller, once at startup*/
+static volatile uint8_t int28j60 = 1;
 
 /*
   Initalize watchdog 2 seconds reset.
@@ -61,6 +136,10 @@ void watchdog_init(void)
 
 
 /*****Interrupt from ENC28J60**************/
+/*
+The cause is read in the main loop, SPI is not used here as the
+interrupt may come in the middle of a transfer.
+*/
 ISR(INT0_vect)
 {
   int28j60 = 1;
@@ -110,6 +189,16 @@ int main (void)
 	ip_init(0,0,0); //Already set
 	arp_init();
 	tcp_init();
+  /* the last bits of the temperature reading are noise */
+  uint8_t i;
+  for(i = 0; i < 32; i++)
+    tcp_add_entropy(adc_read(CHANNEL_0));
+#if SPI_BENCHMARK
+  spi_benchmark();
+#endif
+#if CHECKSUM_BENCHMARK
+  checksum_benchmark();
+#endif
   
   //wdt_reset();
   
@@ -127,13 +216,26 @@ int main (void)
   {
     // wdt_reset();
     if(int28j60){
-      while(handle_ethernet_packet());
+      // cleared first, an interrupt while servicing is not lost
+      int28j60 = 0;
+      ethernet_poll();
     }
+    tcp_poll();
+#if COLLECTOR_ENABLED
+    collector_poll();
+#endif
+#if SPI_COUNT_REPORT_MS
+    spi_count_report();
+#endif
   }
 }
 
 uint8_t httpd_start(void)
 {
+  if(!tcp_cache_p(&httpd_page_1, (const uint8_t *)WEB_PAGE_1) ||
+     !tcp_cache_p(&httpd_page_2, (const uint8_t *)WEB_PAGE_2)){
+    DBG_STATIC("Page is served from flash.");
+  }
   socket = tcp_socket_alloc(httpd_socket_callback);
   
   if(socket < 0){
@@ -157,6 +259,7 @@ void httpd_socket_callback(tcp_socket_t socket,enum tcp_event event)
 	case tcp_event_connection_established:
   {
     DBG_STATIC("tcp_event_connection_established");
+    httpd_connections[socket].receive = httpd_receive_idle;
     break;
   }
 	case tcp_event_data_received:
@@ -171,38 +274,363 @@ void httpd_socket_callback(tcp_socket_t socket,enum tcp_event event)
     DBG_DYNAMIC(buffer);
     
     if(len > 0){
+      struct httpd_connection* connection = &httpd_connections[socket];
+      if(connection->receive == httpd_receive_idle){
+        if(strncmp("POST /TEMP", (char *)msg, 10) == 0){
+          connection->reply = httpd_reply_temperature;
+        } else if (strncmp("GET ",(char *)msg, 4) != 0){
+          connection->reply = httpd_reply_ok;
+        } else {
+          connection->reply = httpd_reply_page;
+        }
+        /*HTTP/1.1 keeps the connection alive by default, HTTP/1.0 only when asked to*/
+        connection->close = (httpd_request_find((const char *)msg, len, PSTR("HTTP/1.0")) != 0);
+        connection->receive = httpd_receive_header;
+        connection->header_end = 0;
+        connection->body = 0;
+      }
+      if(connection->receive == httpd_receive_header){
+        if(httpd_request_find((const char *)msg, len, PSTR("Connection: keep-alive"))){
+          connection->close = 0;
+        }
+        if(httpd_request_find((const char *)msg, len, PSTR("Connection: close"))){
+          connection->close = 1;
+        }
+      }
+      if(!httpd_receive(connection, (const char *)msg, len)){
+        //Wait for the rest of the request
+        break;
+      }
+      connection->receive = httpd_receive_idle;
       const struct temperature_t* temperature = get_temperature();
-      char tempbuff[10];
-      if(strncmp("POST /TEMP", (char *)msg, 10) == 0){
-        tcp_write_p(socket, (const uint8_t *)PSTR("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 6\r\n\r\n"));
-        sprintf(tempbuff, "\"%" PRId16 ".%" PRIu8 "\"", temperature->temp_integer, temperature->temp_decimal);
-        DBG_DYNAMIC(tempbuff);
-        tcp_write(socket, (const uint8_t *)tempbuff);
-      } else if (strncmp("GET ",(char *)msg, 4) != 0){
-        tcp_write_p(socket, (const uint8_t *)PSTR("HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n<h1>200 OK</h1>"));
-      } else {
-        tcp_write_p(socket, (const uint8_t *)PSTR("HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n"));     
-        tcp_write_p(socket, (const uint8_t *)WEB_PAGE_1);
-        sprintf(tempbuff, "%" PRId16 ".%" PRIu8, temperature->temp_integer, temperature->temp_decimal);
-        tcp_write(socket, (const uint8_t *)tempbuff);
-        tcp_write_p(socket, (const uint8_t *)WEB_PAGE_2);
+      snprintf(connection->temperature, sizeof(connection->temperature), "%" PRId16 ".%" PRIu8, temperature->temp_integer, temperature->temp_decimal);
+      DBG_DYNAMIC(connection->temperature);
+      httpd_send_reply(socket);
+      if(connection->close){
+        tcp_close(socket);
       }
     } else {
       DBG_STATIC("No data received");
       return;
     }
     break;
+  }
+	case tcp_event_data_send:
+	case tcp_event_data_regenerate:
+  {
+    httpd_send_reply(socket);
+    break;
   }
 	case tcp_event_connection_closing:
   {
     DBG_STATIC("tcp_event_connection_closing");
     break;
+  }
+	case tcp_event_connection_idle:
+  {
+    DBG_STATIC("tcp_event_connection_idle");
+    break;
   }
 	default:
 	break;
 	}
 }
 
+void httpd_send_reply(tcp_socket_t socket)
+{
+  const struct httpd_connection* connection = &httpd_connections[socket];
+  switch(connection->reply)
+  {
+  case httpd_reply_temperature:
+    httpd_send_header(socket, PSTR("application/json"), strlen(connection->temperature) + 2);
+    tcp_write_p(socket, (const uint8_t *)PSTR("\""));
+    tcp_write(socket, (const uint8_t *)connection->temperature);
+    tcp_write_p(socket, (const uint8_t *)PSTR("\""));
+    break;
+  case httpd_reply_ok:
+    httpd_send_header(socket, PSTR("text/html"), strlen_P(PSTR("<h1>200 OK</h1>")));
+    tcp_write_p(socket, (const uint8_t *)PSTR("<h1>200 OK</h1>"));
+    break;
+  case httpd_reply_page:
+    httpd_send_header(socket, PSTR("text/html"), httpd_page_1.length + strlen(connection->temperature) + httpd_page_2.length);
+    tcp_write_cached(socket, &httpd_page_1);
+    tcp_write(socket, (const uint8_t *)connection->temperature);
+    tcp_write_cached(socket, &httpd_page_2);
+    break;
+  default:
+    break;
+  }
+}
 
+/*
+  Status line and headers. The length lets the client find the end of the
+  reply without the connection being closed.
+*/
+void httpd_send_header(tcp_socket_t socket, PGM_P content_type, uint16_t length)
+{
+  char buffer[8];
+  tcp_write_p(socket, (const uint8_t *)PSTR("HTTP/1.1 200 OK\r\nContent-Type: "));
+  tcp_write_p(socket, (const uint8_t *)content_type);
+  tcp_write_p(socket, (const uint8_t *)PSTR("\r\nContent-Length: "));
+  snprintf(buffer, sizeof(buffer), "%" PRIu16, length);
+  tcp_write(socket, (const uint8_t *)buffer);
+  if(httpd_connections[socket].close){
+    tcp_write_p(socket, (const uint8_t *)PSTR("\r\nConnection: close"));
+  }
+  tcp_write_p(socket, (const uint8_t *)PSTR("\r\n\r\n"));
+}
 
+/*
+  Header names are case insensitive, the request is not null terminated.
+*/
+const char* httpd_request_find(const char* msg, uint16_t len, PGM_P text)
+{
+  uint16_t text_len = strlen_P(text);
+  for(; len >= text_len; len--, msg++){
+    if(strncasecmp_P(msg, text, text_len) == 0){
+      return msg;
+    }
+  }
+  return 0;
+}
 
+/*
+  Follows the request through the segments it arrives in,
+  returns 1 once the headers and the body are complete.
+*/
+uint8_t httpd_receive(struct httpd_connection* connection, const char* msg, uint16_t len)
+{
+  if(connection->receive == httpd_receive_header){
+    uint16_t header_len = 0;
+    while(header_len < len && connection->header_end < 4){
+      char c = msg[header_len++];
+      if(c == "\r\n\r\n"[connection->header_end]){
+        connection->header_end++;
+      } else {
+        connection->header_end = (c == '\r') ? 1 : 0;
+      }
+    }
+    const char* length = httpd_request_find(msg, header_len, PSTR("Content-Length:"));
+    if(length){
+      const char* end = msg + header_len;
+      uint16_t body = 0;
+      for(length += 15; length < end && *length == ' '; length++);
+      for(; length < end && *length >= '0' && *length <= '9'; length++){
+        body = body * 10 + (*length - '0');
+      }
+      connection->body = body;
+    }
+    if(connection->header_end < 4){
+      return 0;
+    }
+    connection->receive = httpd_receive_body;
+    msg += header_len;
+    len -= header_len;
+  }
+  if(len >= connection->body){
+    connection->body = 0;
+  } else {
+    connection->body -= len;
+  }
+  return connection->body == 0;
+}
+
+#if COLLECTOR_ENABLED
+void collector_poll(void)
+{
+  uint16_t ticks = timer_get_ticks();
+  if((uint16_t)(ticks - collector_ticks) < COLLECTOR_INTERVAL_MS / TIMER_MS_PER_TICK){
+    return;
+  }
+  collector_ticks = ticks;
+  if(collector_socket < 0){
+    collector_socket = tcp_socket_alloc(collector_socket_callback);
+    if(collector_socket < 0){
+      return;
+    }
+  }
+  if(!collector_connected){
+    tcp_connect(collector_socket, &collector_ip, COLLECTOR_PORT);
+    return;
+  }
+  if(collector_pending){
+    DBG_STATIC("Collector busy, sample skipped.");
+    return;
+  }
+  const struct temperature_t* temperature = get_temperature();
+  snprintf(collector_sample, sizeof(collector_sample), "%" PRId16 ".%" PRIu8, temperature->temp_integer, temperature->temp_decimal);
+  collector_pending = tcp_send(collector_socket);
+}
+
+void collector_socket_callback(tcp_socket_t socket,enum tcp_event event)
+{
+  switch(event)
+  {
+  case tcp_event_connection_established:
+    DBG_STATIC("Collector connected.");
+    collector_connected = 1;
+    collector_pending = 0;
+    break;
+  case tcp_event_data_send:
+  case tcp_event_data_regenerate:
+    tcp_write_p(socket, (const uint8_t *)PSTR("temperature "));
+    tcp_write(socket, (const uint8_t *)collector_sample);
+    tcp_write_p(socket, (const uint8_t *)PSTR("\n"));
+    break;
+  case tcp_event_data_acked:
+    collector_pending = 0;
+    break;
+  case tcp_event_connection_closed:
+  case tcp_event_reset:
+  case tcp_event_timeout:
+    DBG_STATIC("Collector disconnected.");
+    collector_connected = 0;
+    break;
+  default:
+    break;
+  }
+}
+#endif
+
+#if SPI_BENCHMARK
+/*
+  Reports the buffer write and read throughput for bursts of several
+  sizes, each burst includes setting the buffer pointer. The writes
+  stream RAM from RAMSTART as checksum_benchmark() does, the reads only
+  clock the bytes in, bursts up to a full frame fit in neither
+  ethernet_buffer nor anywhere else in RAM. Timer 1 counts CPU
+  cycles / 8 and wraps every tick (OCR1A + 1 counts).
+*/
+void spi_benchmark(void)
+{
+  static const uint16_t sizes[] PROGMEM = {64, 128, 256, 512, 1024, 1500};
+  char buffer[40];
+  uint8_t i, read;
+  uint16_t n;
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    uint16_t len = pgm_read_word(&sizes[i]);
+    for(read = 0; read < 2; read++)
+    {
+      uint16_t ticks = timer_get_ticks();
+      uint16_t start = TCNT1;
+      for(n = 0; n < SPI_BENCHMARK; n++)
+      {
+        if(read)
+        {
+          /* read back what has been written to the transmit buffer */
+          Enc28j60Write16(ERDPTL, TXSTART_INIT + 1);
+          Enc28j60SkipBuffer(len);
+        }
+        else
+        {
+          Enc28j60TxSeek(0);
+          Enc28j60WriteBuffer(len, (uint8_t*)RAMSTART);
+        }
+      }
+      uint16_t end = TCNT1;
+      ticks = timer_get_ticks() - ticks;
+      uint32_t cycles = ((uint32_t)ticks * (OCR1A + 1) + end - start) * 8;
+      uint32_t rate = (uint32_t)len * SPI_BENCHMARK * (F_CPU / 1000) / cycles;
+      sprintf(buffer, "SPI %s %" PRIu16 " B: %" PRIu32 " kB/s", read ? "read" : "write", len, rate);
+      DBG_DYNAMIC(buffer);
+    }
+  }
+}
+#endif
+
+#if CHECKSUM_BENCHMARK
+/*
+  RFC 1071 word by word, each carry added back at once.
+*/
+static uint16_t checksum_fold(const uint8_t* data, uint16_t len)
+{
+  uint16_t checksum = 0;
+  uint16_t i;
+  for(i = 0; i < len; i += 2){
+    uint16_t word = (uint16_t)data[i] << 8;
+    if(i + 1 < len){
+      word |= data[i + 1];
+    }
+    checksum += word;
+    if(checksum < word){
+      checksum++;
+    }
+  }
+  return checksum;
+}
+
+/*
+  Compares net_get_checksum() with checksum_fold() at every alignment and
+  odd and even lengths, on the first kilobyte of RAM and on ethernet_buffer
+  full of carries. Then reports the cycles per 100 bytes taken by
+  net_get_checksum(), timed as in spi_benchmark().
+*/
+void checksum_benchmark(void)
+{
+  static const uint16_t sizes[] PROGMEM = {20, 64, 255, 512, 1024};
+  const uint8_t* ram = (const uint8_t*)RAMSTART;
+  char buffer[40];
+  uint16_t len, n, errors = 0;
+  uint8_t offset;
+  memset(ethernet_buffer, 0xff, ETHERNET_BUFFER_SIZE);
+  for(offset = 0; offset < 4; offset++)
+  {
+    for(len = 0; len < 1024; len += (len < 64) ? 1 : 61)
+    {
+      /*the stack and the interrupt handlers must not change RAM in between*/
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        if(net_get_checksum(0, ram + offset, len, 1) != checksum_fold(ram + offset, len)){
+          errors++;
+        }
+      }
+      if(len < ETHERNET_BUFFER_SIZE - offset &&
+         net_get_checksum(0, ethernet_buffer + offset, len, 1) != checksum_fold(ethernet_buffer + offset, len)){
+        errors++;
+      }
+    }
+  }
+  uint8_t i;
+  sprintf(buffer, "Checksum errors: %" PRIu16, errors);
+  DBG_DYNAMIC(buffer);
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    len = pgm_read_word(&sizes[i]);
+    uint16_t ticks = timer_get_ticks();
+    uint16_t start = TCNT1;
+    for(n = 0; n < CHECKSUM_BENCHMARK; n++)
+    {
+      net_get_checksum(0, ram, len, 1);
+    }
+    uint16_t end = TCNT1;
+    ticks = timer_get_ticks() - ticks;
+    uint32_t cycles = ((uint32_t)ticks * (OCR1A + 1) + end - start) * 8;
+    uint32_t per_byte = cycles * 100 / ((uint32_t)len * CHECKSUM_BENCHMARK);
+    sprintf(buffer, "Checksum %" PRIu16 " B: %" PRIu32 " cycles/100 B", len, per_byte);
+    DBG_DYNAMIC(buffer);
+  }
+}
+#endif
+
+#if SPI_COUNT_REPORT_MS
+#if !ENC28J60_SPI_COUNT
+#error SPI_COUNT_REPORT_MS needs ENC28J60_SPI_COUNT
+#endif
+/*
+  Prints the SPI transactions, chip select cycles, since Enc28j60Init()
+  and their average per received or sent frame.
+*/
+void spi_count_report(void)
+{
+  static uint16_t report_ticks;
+  char buffer[48];
+  uint16_t ticks = timer_get_ticks();
+  if((uint16_t)(ticks - report_ticks) < SPI_COUNT_REPORT_MS / TIMER_MS_PER_TICK){
+    return;
+  }
+  report_ticks = ticks;
+  sprintf(buffer, "SPI: %" PRIu32 " transactions, %" PRIu16 " per frame", Enc28j60SpiCount(), ethernet_get_spi_per_frame());
+  DBG_DYNAMIC(buffer);
+}
+#endif
@@ -3,7 +3,9 @@
 #include <enc28j60.h>
 #include <ip.h>
 #include <arp.h>
+#include <webb_config.h>
 #include <string.h>
+#include <avr/pgmspace.h>
 
 #include "../debug.h"
 
@@ -18,14 +20,24 @@ struct ethernet_stats
 {
 	uint32_t rx_packets;
 	uint32_t tx_packets;
+	uint16_t rx_drops[ethernet_drop_reasons];
+	uint16_t recoveries[ethernet_recoveries];
 };
 
 static struct ethernet_stats ethernet_stats;
 static ethernet_address ethernet_mac;
+/* length of the received frame and how much of it is in ethernet_buffer */
+static uint16_t ethernet_rx_length;
+static uint16_t ethernet_rx_fetched;
+/* bytes of the controller's cache in use */
+static uint16_t ethernet_cache_used;
+static uint8_t ethernet_link;
 
-uint8_t ethernet_buffer[ETHERNET_MAX_PACKET_SIZE + NET_HEADER_SIZE_ETHERNET];
+uint8_t ethernet_buffer[ETHERNET_BUFFER_SIZE];
 
 
+static void ethernet_rx_filter(void);
+
 void ethernet_init(const ethernet_address * mac)
 {
 	memset(&ethernet_stats,0,sizeof(ethernet_stats));
@@ -33,6 +45,33 @@ void ethernet_init(const ethernet_address * mac)
 	if(mac) {
     memcpy(&ethernet_mac,mac,sizeof(ethernet_mac));  
   }
+	ethernet_rx_filter();
+	/* later changes are reported by EIR.LINKIF */
+	ethernet_link = Enc28j60LinkUp();
+}
+
+/*
+  The controller drops frames the stack does not serve: unicast to other
+  addresses, broadcasts as set by ETHERNET_RX_BROADCAST and multicasts
+  to groups not joined.
+*/
+void ethernet_rx_filter(void)
+{
+	uint8_t filter = ERXFCON_UCEN | ERXFCON_CRCEN;
+#if ETHERNET_RX_BROADCAST == ETHERNET_BROADCAST_ARP
+	/* broadcast destination and ARP type, bytes 0-5 and 12-13 */
+	const uint8_t mask[8] = {0x3f,0x30,0,0,0,0,0,0};
+	const uint8_t pattern[8] = {0xff,0xff,0xff,0xff,0xff,0xff,
+		ETHERNET_TYPE_ARP >> 8,ETHERNET_TYPE_ARP & 0xff};
+	Enc28j60SetPattern(0,mask,~net_get_checksum(0,pattern,sizeof(pattern),1));
+	filter |= ERXFCON_PMEN;
+#elif ETHERNET_RX_BROADCAST == ETHERNET_BROADCAST_ALL
+	filter |= ERXFCON_BCEN;
+#endif
+#if ETHERNET_RX_MULTICAST
+	filter |= ERXFCON_HTEN;
+#endif
+	Enc28j60SetFilter(filter);
 }
 
 const ethernet_address * ethernet_get_mac()
@@ -40,15 +79,102 @@ const ethernet_address * ethernet_get_mac()
 	return (const ethernet_address*)&ethernet_mac;
 }
 
+/* Frames to the group pass the hash filter, others may too */
+void ethernet_multicast_join(const ethernet_address * group)
+{
+	Enc28j60HashAdd((const uint8_t*)group);
+}
+
+void ethernet_drop(enum ethernet_drop reason)
+{
+	ethernet_stats.rx_drops[reason]++;
+}
+
+uint16_t ethernet_get_drops(enum ethernet_drop reason)
+{
+	return ethernet_stats.rx_drops[reason];
+}
+
+uint16_t ethernet_get_recoveries(enum ethernet_recovery recovery)
+{
+	/* the driver resets the receive logic on its own */
+	if(recovery == ethernet_recovery_rx_reset)
+		return Enc28j60RxResets();
+	return ethernet_stats.recoveries[recovery];
+}
+
+/* Link state as last reported by the PHY */
+uint8_t ethernet_link_up(void)
+{
+	return ethernet_link;
+}
+
+#if ENC28J60_SPI_COUNT
+/* average SPI transactions spent on a received or sent frame */
+uint16_t ethernet_get_spi_per_frame(void)
+{
+	uint32_t frames = ethernet_stats.rx_packets + ethernet_stats.tx_packets;
+	return frames ? Enc28j60SpiCount() / frames : 0;
+}
+#endif
+
+/*
+  Services the controller after it raised its interrupt. At most
+  ETHERNET_RX_BURST frames are handled, frames left over raise
+  the interrupt again.
+*/
+void ethernet_poll(void)
+{
+  uint8_t events = Enc28j60IntBegin();
+  uint8_t i;
+  if(events & EIR_LINKIF){
+    ethernet_link = Enc28j60LinkUp();
+    if(ethernet_link){
+      DBG_STATIC("Link up.");
+    } else {
+      DBG_STATIC("Link down.");
+      /* queued frames would go out stale once the link is back */
+      Enc28j60TxReset();
+      ethernet_stats.recoveries[ethernet_recovery_link_down]++;
+      ip_link_down();
+    }
+  }
+  /* the buffer was full and new frames were lost, the ones in it are
+     intact and handled below; Enc28j60PacketReceiveHeader() resets
+     the receive logic if the next packet pointer or the length it
+     reads show the buffer out of step */
+  if(events & EIR_RXERIF){
+    Enc28j60IntClear(EIR_RXERIF);
+    ethernet_stats.recoveries[ethernet_recovery_overflow]++;
+  }
+  if(events & (EIR_TXIF | EIR_TXERIF)){
+    Enc28j60TxPoll();
+  }
+  /* EIR.PKTIF is not reliable, see Rev. B4 Silicon Errata point 6,
+     handle_ethernet_packet() looks at the packet count instead */
+  for(i = 0; i < ETHERNET_RX_BURST; i++){
+    if(!handle_ethernet_packet()){
+      break;
+    }
+  }
+  Enc28j60IntEnd();
+}
+
+/*
+  Handles one received frame, returns 0 if none was waiting.
+*/
 uint8_t handle_ethernet_packet()
 {
   uint16_t packet_size = 0;
   
-  packet_size = Enc28j60PacketReceive(sizeof(ethernet_buffer), ethernet_buffer);
+  /* the whole length is reported, the payload stays in the controller */
+  packet_size = Enc28j60PacketReceiveHeader(sizeof(ethernet_buffer), ETHERNET_RX_HEADER, ethernet_buffer);
 
   if (packet_size == 0){
     return 0; 
   }
+  ethernet_rx_length = packet_size;
+  ethernet_rx_fetched = (packet_size < ETHERNET_RX_HEADER) ? packet_size : ETHERNET_RX_HEADER;
   // char buffer[30];
   // sprintf(buffer, "ETH packet length: %" PRIu16, packet_size);
   // DBG_DYNAMIC(buffer);
@@ -59,18 +185,17 @@ uint8_t handle_ethernet_packet()
   
   uint8_t* data = (uint8_t*)(header +1);
   
-  uint8_t ret=1;
   switch(header->type)
   {
     case HTON16(ETHERNET_TYPE_IP):
       //DBG_STATIC("Recieved IP packet.");
       //IP handle packet
-      ret = ip_handle_packet((struct ip_header*)data,packet_size,(const ethernet_address*)&header->src);
+      ip_handle_packet((struct ip_header*)data,packet_size,(const ethernet_address*)&header->src);
       break;
     case HTON16(ETHERNET_TYPE_ARP):
       //DBG_STATIC("Recieved ARP packet.");
       //ARP handle packet
-      ret = arp_handle_packet((struct arp_header*)data,packet_size);
+      arp_handle_packet((struct arp_header*)data,packet_size);
       // if(ret){
         // DBG_STATIC("ARP packet successfully handled.");
       // } else {
@@ -78,15 +203,29 @@ uint8_t handle_ethernet_packet()
       // }
       break;
     default:
-      return 0;
+      ethernet_drop(ethernet_drop_type);
+      Enc28j60PacketFree();
+      return 1;
   }
+  /* the frame is kept in the controller for ethernet_rx_fetch() and
+     ethernet_rx_checksum() */
+  Enc28j60PacketFree();
   ethernet_stats.rx_packets++;
-  return ret;
+  return 1;
 }
 
 uint8_t ethernet_send_packet(ethernet_address * dst,uint16_t type,uint16_t len)
 {
-	if(len > ETHERNET_MAX_PACKET_SIZE -NET_HEADER_SIZE_ETHERNET){
+	return ethernet_send_frame(dst,type,len,len);
+}
+
+/*
+  Only the first buffered bytes of the payload are taken from
+  ethernet_buffer, the rest has been written with ethernet_tx_write().
+*/
+uint8_t ethernet_send_frame(ethernet_address * dst,uint16_t type,uint16_t len,uint16_t buffered)
+{
+	if(buffered > ethernet_get_buffer_size()){
 		return 0;
   }
 	struct ethernet_header * header = (struct ethernet_header*)ethernet_buffer;
@@ -98,6 +237,149 @@ uint8_t ethernet_send_packet(ethernet_address * dst,uint16_t type,uint16_t len)
   memcpy(&header->src,&ethernet_mac,sizeof(ethernet_address));
 	header->type = hton16(type);
 	ethernet_stats.tx_packets++;
-	return Enc28j60PacketSend((len + NET_HEADER_SIZE_ETHERNET), ethernet_buffer);			
+	return Enc28j60PacketSendHeader((len + NET_HEADER_SIZE_ETHERNET), (buffered + NET_HEADER_SIZE_ETHERNET), ethernet_buffer);			
 }
 
+void ethernet_tx_seek(uint16_t offset)
+{
+	Enc28j60TxSeek(NET_HEADER_SIZE_ETHERNET + offset);
+}
+
+void ethernet_tx_write(const uint8_t * data,uint16_t len)
+{
+	Enc28j60WriteBuffer(len, (uint8_t*)data);
+}
+
+/* Same as ethernet_tx_write(), returns the one's complement sum of data */
+uint16_t ethernet_tx_write_sum(const uint8_t * data,uint16_t len)
+{
+	return Enc28j60WriteBufferSum(len, (uint8_t*)data);
+}
+
+/*
+  Makes sure the received frame is in ethernet_buffer up to end,
+  the frame is copied from the controller only as far as needed.
+  The driver terminates the data with a 0, so the last byte of
+  ethernet_buffer is never part of the frame.
+*/
+void ethernet_rx_fetch(const uint8_t * end)
+{
+	uint16_t length = end - ethernet_buffer;
+	if(length > ethernet_rx_length)
+		length = ethernet_rx_length;
+	if(length > sizeof(ethernet_buffer) - 1)
+		length = sizeof(ethernet_buffer) - 1;
+	if(length <= ethernet_rx_fetched)
+		return;
+	Enc28j60PacketRead(ethernet_rx_fetched,length - ethernet_rx_fetched,ethernet_buffer + ethernet_rx_fetched);
+	ethernet_rx_fetched = length;
+}
+
+/*
+  Reads len received bytes, starting skip bytes behind data which points
+  into the frame, into ethernet_buffer at data. Only what fits in front
+  of the end of ethernet_buffer is read, returns the number of bytes.
+*/
+uint16_t ethernet_rx_window(const uint8_t * data,uint16_t skip,uint16_t len)
+{
+	uint16_t start = data - ethernet_buffer;
+	uint16_t room = sizeof(ethernet_buffer) - 1 - start;
+	if(len > room)
+		len = room;
+	if(skip == 0)
+	{
+		ethernet_rx_fetch(data + len);
+		return len;
+	}
+	Enc28j60PacketRead(start + skip,len,(uint8_t*)data);
+	/* the window no longer holds the frame as received */
+	if(ethernet_rx_fetched > start)
+		ethernet_rx_fetched = start;
+	return len;
+}
+
+/*
+  Copies len received bytes at data, which points into the frame in
+  ethernet_buffer, offset bytes behind the ethernet header of the frame
+  being built. The copy is done inside the controller.
+*/
+void ethernet_rx_copy(const uint8_t * data,uint16_t len,uint16_t offset)
+{
+	Enc28j60PacketCopy(data - ethernet_buffer,len,NET_HEADER_SIZE_ETHERNET + offset);
+}
+
+/*
+  Adds the one's complement sum of len received bytes at data,
+  which points into the frame in ethernet_buffer, to checksum.
+*/
+uint16_t ethernet_rx_checksum(uint16_t checksum,const uint8_t * data,uint16_t len)
+{
+#if NET_CHECKSUM_OFFLOAD
+	if(len == 0)
+		return checksum;
+	return net_add_checksum(checksum,~Enc28j60RxChecksum(data - ethernet_buffer,len));
+#else
+	uint16_t start = data - ethernet_buffer;
+	uint16_t end = start + len;
+	ethernet_rx_fetch(data);
+	uint16_t fetched = ethernet_rx_fetched;
+	/* skip offset 1 is never hit, the sum advances in steps of two */
+	if(fetched >= end)
+		return net_get_checksum(checksum,data,len,1);
+	/* sum what is there, the rest is summed while it is read into
+	   the space behind it, an even number of bytes at a time */
+	checksum = net_get_checksum(checksum,data,fetched - start,1);
+	uint16_t window = (sizeof(ethernet_buffer) - 1 - fetched) & ~1;
+	uint16_t offset;
+	for(offset = fetched ; offset < end ; offset += window)
+	{
+		uint16_t chunk = (end - offset < window) ? end - offset : window;
+		uint16_t sum = Enc28j60PacketReadSum(offset,chunk,ethernet_buffer + fetched);
+		/* data starting on an odd offset is summed with swapped bytes */
+		if((offset - start) & 1)
+			sum = (sum<<8) | (sum>>8);
+		checksum = net_add_checksum(checksum,sum);
+	}
+	/* the frame is kept in ethernet_buffer only if it fit */
+	if(end - fetched <= window)
+		ethernet_rx_fetched = end;
+	return checksum;
+#endif
+}
+
+/* One's complement sum of len bytes written offset bytes behind the ethernet header */
+uint16_t ethernet_tx_checksum(uint16_t offset,uint16_t len)
+{
+	if(len == 0)
+		return 0;
+	return ~Enc28j60TxChecksum(NET_HEADER_SIZE_ETHERNET + offset,len);
+}
+
+/*
+  Keeps a copy of len bytes of flash at data_p in the controller, returns
+  its position in the cache or ETHERNET_CACHE_NONE if it does not fit.
+  Only to be called while no frame is being built.
+*/
+uint16_t ethernet_cache_store_p(const uint8_t * data_p,uint16_t len)
+{
+	if(len > ENC28J60_CACHE_SIZE - ethernet_cache_used)
+		return ETHERNET_CACHE_NONE;
+	uint16_t cache = ethernet_cache_used;
+	uint8_t chunk[32];
+	while(len > 0)
+	{
+		uint8_t chunk_len = (len > sizeof(chunk)) ? sizeof(chunk) : len;
+		memcpy_P(chunk,data_p,chunk_len);
+		Enc28j60CacheWrite(ethernet_cache_used,chunk_len,chunk);
+		ethernet_cache_used += chunk_len;
+		data_p += chunk_len;
+		len -= chunk_len;
+	}
+	return cache;
+}
+
+/* Copies len cached bytes offset bytes behind the ethernet header of the frame being built */
+void ethernet_cache_copy(uint16_t cache,uint16_t len,uint16_t offset)
+{
+	Enc28j60CacheCopy(cache,len,NET_HEADER_SIZE_ETHERNET + offset);
+}
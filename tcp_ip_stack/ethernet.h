@@ -11,6 +11,31 @@
   struct ethernet_stats;
 
   #define ETHERNET_ADDR_BROADCAST	0
+  #define ETHERNET_CACHE_NONE		0xffff
+  
+  /* broadcast frames the controller accepts */
+  #define ETHERNET_BROADCAST_NONE	0
+  #define ETHERNET_BROADCAST_ARP	1
+  #define ETHERNET_BROADCAST_ALL	2
+  
+  /* frames the controller let through but the stack dropped */
+  enum ethernet_drop
+  {
+    ethernet_drop_type = 0,	/* neither IP nor ARP */
+    ethernet_drop_ip,		/* not for us or malformed */
+    ethernet_drop_checksum,
+    ethernet_drop_port,		/* no socket for the segment */
+    ethernet_drop_reasons
+  };
+  
+  /* ways the controller was brought back after trouble */
+  enum ethernet_recovery
+  {
+    ethernet_recovery_overflow = 0,	/* receive buffer full, frames lost */
+    ethernet_recovery_rx_reset,		/* receive buffer out of step, reset */
+    ethernet_recovery_link_down,	/* link lost, transmit queue flushed */
+    ethernet_recoveries
+  };
   
   extern uint8_t ethernet_buffer[];
   
@@ -18,12 +43,34 @@
   
   
   const ethernet_address * ethernet_get_mac(void);
+  void ethernet_multicast_join(const ethernet_address * group);
+  void ethernet_drop(enum ethernet_drop reason);
+  uint16_t ethernet_get_drops(enum ethernet_drop reason);
+  uint16_t ethernet_get_recoveries(enum ethernet_recovery recovery);
+  uint8_t ethernet_link_up(void);
+  /* needs ENC28J60_SPI_COUNT */
+  uint16_t ethernet_get_spi_per_frame(void);
+  void ethernet_poll(void);
   uint8_t handle_ethernet_packet(void);
   uint8_t ethernet_send_packet(ethernet_address * dst,uint16_t type,uint16_t len);
+  uint8_t ethernet_send_frame(ethernet_address * dst,uint16_t type,uint16_t len,uint16_t buffered);
+  
+  /* Payload written straight into the controller's transmit buffer,
+     offset counts from the end of the ethernet header */
+  void ethernet_tx_seek(uint16_t offset);
+  void ethernet_tx_write(const uint8_t * data,uint16_t len);
+  uint16_t ethernet_tx_write_sum(const uint8_t * data,uint16_t len);
+  void ethernet_rx_fetch(const uint8_t * end);
+  uint16_t ethernet_rx_window(const uint8_t * data,uint16_t skip,uint16_t len);
+  void ethernet_rx_copy(const uint8_t * data,uint16_t len,uint16_t offset);
+  uint16_t ethernet_cache_store_p(const uint8_t * data_p,uint16_t len);
+  void ethernet_cache_copy(uint16_t cache,uint16_t len,uint16_t offset);
+  uint16_t ethernet_rx_checksum(uint16_t checksum,const uint8_t * data,uint16_t len);
+  uint16_t ethernet_tx_checksum(uint16_t offset,uint16_t len);
 
   #define ethernet_get_buffer()	(&ethernet_buffer[NET_HEADER_SIZE_ETHERNET])
   #define ethernet_get_broadcast()
-  #define ethernet_get_buffer_size() (ETHERNET_MAX_PACKET_SIZE -NET_HEADER_SIZE_ETHERNET)
+  #define ethernet_get_buffer_size() (ETHERNET_BUFFER_SIZE -NET_HEADER_SIZE_ETHERNET)
 
   
 #endif
@@ -21,6 +21,9 @@
 #define ICMP_TYPE_ECHO_REQUEST			0x08
 #define ICMP_TYPE_DESTINATION_UNREACHABLE	0x03
 
+/* header, identifier and sequence number of echo messages */
+#define ICMP_ECHO_HEADER_SIZE			8
+
 struct	icmp_header
 {
 	uint8_t type;
@@ -36,9 +39,12 @@ uint8_t icmp_handle_packet(const ip_address * ip_addr,const struct icmp_header *
 	if(packet_len < sizeof(struct icmp_header))
 		return 0;
 	
-	/* check checksum */
-	if(hton16(icmp->checksum) != ~net_get_checksum(0,(uint8_t*)icmp,packet_len,2))
+	/* check checksum, summed with its checksum field a valid message gives 0xffff */
+	if(ethernet_rx_checksum(0,(const uint8_t*)icmp,packet_len) != 0xffff)
+	{
+		ethernet_drop(ethernet_drop_checksum);
 		return 0;
+	}
 		/* parse icmp packet */
 	switch(icmp->type)
 	{
@@ -56,16 +62,25 @@ uint8_t icmp_send_echo_reply(const ip_address * ip_addr,const struct icmp_header
 {
 	struct icmp_header * icmp_reply = (struct icmp_header*)ip_get_buffer();
 	
-	memcpy(icmp_reply,icmp,packet_len);
+	/* identifier and sequence number follow the header */
+	uint16_t header_len = (packet_len < ICMP_ECHO_HEADER_SIZE) ? packet_len : ICMP_ECHO_HEADER_SIZE;
+	
+	/* the header is answered in place unless the request carried ip options */
+	if(icmp_reply != icmp)
+		memmove(icmp_reply,icmp,header_len);
+	
+	/* the echoed data is copied inside the controller */
+	ethernet_rx_copy((const uint8_t*)icmp + header_len,packet_len - header_len,NET_HEADER_SIZE_IP + header_len);
 	
 	/* set type */
 	icmp_reply->type = ICMP_TYPE_ECHO_REPLY;
 	
-	/* compute checksum */
-	icmp_reply->checksum = hton16(~net_get_checksum(0,(const uint8_t*)icmp_reply,packet_len,2));
+	/* only the type changed, adjust the checksum of the request */
+	icmp_reply->checksum = hton16(net_adjust_checksum(ntoh16(icmp_reply->checksum),
+		MAKEUINT16(ICMP_TYPE_ECHO_REQUEST,icmp_reply->code),MAKEUINT16(ICMP_TYPE_ECHO_REPLY,icmp_reply->code)));
 	
 	/* send ip packet */
-	return ip_send_packet(ip_addr,IP_PROTOCOL_ICMP,packet_len);
+	return ip_send_frame(ip_addr,IP_PROTOCOL_ICMP,packet_len,header_len);
 			
 }
 
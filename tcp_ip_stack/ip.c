@@ -125,6 +125,12 @@ static ip_address ip_gateway = NET_IP_GATEWAY;
  */
 static ip_address ip_broadcast;
 
+/**
+ * Header of sent packets with zero length, protocol and destination,
+ * ip_send_frame() adjusts its checksum for them
+ */
+static struct ip_header ip_header_template;
+
 
 /**
  * Checks if specified ip address is the broadcast address
@@ -149,6 +155,11 @@ const ip_address * ip_get_gateway(void)		{return (const ip_address*)&ip_gateway;
  */
 static void ip_set_broadcast(void);
 
+/**
+ *
+ */
+static void ip_set_header_template(void);
+
 /**
  *
  */
@@ -165,6 +176,7 @@ void ip_init(const ip_address * addr,const ip_address * netmask,const ip_address
 		memcpy(&ip_netmask,netmask,sizeof(ip_address));
 	if(gateway)
 		memcpy(&ip_gateway,gateway,sizeof(ip_address));
+	ip_set_header_template();
 }
 
 
@@ -172,6 +184,14 @@ void ip_init(const ip_address * addr,const ip_address * netmask,const ip_address
  *
  */
 uint8_t ip_send_packet(const ip_address * ip_dst,uint8_t protocol,uint16_t length)
+{
+	return ip_send_frame(ip_dst,protocol,length,length);
+}
+
+/**
+ *
+ */
+uint8_t ip_send_frame(const ip_address * ip_dst,uint8_t protocol,uint16_t length,uint16_t buffered)
 {
 	ethernet_address mac;
 	
@@ -202,61 +222,79 @@ uint8_t ip_send_packet(const ip_address * ip_dst,uint8_t protocol,uint16_t lengt
 	}
 	struct ip_header * ip = (struct ip_header*)ethernet_get_buffer();
 	
-	/* clear ip header */
-	memset(ip,0,sizeof(struct ip_header));
-	
-	/* set version */
-	ip->vihl.version = (IP_V4)<<4;
+	/* a reply built in place gets ip_dst from the received header,
+	   the template overwrites it */
+	ip_address dst;
+	memcpy(&dst,ip_dst,sizeof(ip_address));
 	
-	/* set header length */
-	ip->vihl.header_length |= (sizeof(struct ip_header) / 4) & 0xf;
+	/* start from the template */
+	memcpy(ip,&ip_header_template,sizeof(struct ip_header));
+	uint16_t checksum = ntoh16(ip_header_template.checksum);
 	
 	/* set ip packet length */
 	uint16_t total_len = (uint16_t)sizeof(struct ip_header) + length;
 	ip->length = hton16(total_len);
-	
-	/* set time to live */
-	ip->ttl = 64;
+	checksum = net_adjust_checksum(checksum,0,total_len);
 	
 	/* set protocol */
 	ip->protocol = protocol;
-	
-	/* set src addr */
-	memcpy(&ip->src,ip_get_addr(),sizeof(ip_address));
+	checksum = net_adjust_checksum(checksum,MAKEUINT16(ip->ttl,0),MAKEUINT16(ip->ttl,protocol));
 	
 	/* set dst addr */
-	memcpy(&ip->dst,ip_dst,sizeof(ip_address));
+	memcpy(&ip->dst,&dst,sizeof(ip_address));
+	checksum = net_adjust_checksum(checksum,0,MAKEUINT16(ip->dst[0],ip->dst[1]));
+	checksum = net_adjust_checksum(checksum,0,MAKEUINT16(ip->dst[2],ip->dst[3]));
 	
-	/* compute checksum */
-	ip->checksum = hton16(~net_get_checksum(0,(const uint8_t*)ip,sizeof(struct ip_header),10));
+	ip->checksum = hton16(checksum);
 	
 	/* send packet */
-	return ethernet_send_packet(&mac,ETHERNET_TYPE_IP,total_len);
+	return ethernet_send_frame(&mac,ETHERNET_TYPE_IP,total_len,(uint16_t)sizeof(struct ip_header) + buffered);
 }
 
 
+void ip_link_down(void)
+{
+	tcp_link_down();
+}
+
 uint8_t ip_handle_packet(struct ip_header * header, uint16_t packet_len,const ethernet_address * mac )
 {	
 	if(packet_len < sizeof(struct ip_header))
+	{
+		ethernet_drop(ethernet_drop_ip);
 		return 0;
+	}
 
 	/* Check IP version */
 	if((header->vihl.version>>4) != IP_V4)
+	{
+		ethernet_drop(ethernet_drop_ip);
 		return 0;
+	}
 
 	/* get header length */
 	uint8_t header_length = (header->vihl.header_length & IP_VIHL_HL_MASK)*4;
 	
+	/* with options the header and the one of the upper layer reach
+	   behind the part of the frame copied so far */
+	ethernet_rx_fetch((const uint8_t*)header + header_length + NET_HEADER_SIZE_TCP);
+	
 	/* get packet length */
 	uint16_t packet_length = ntoh16(header->length);
 	
 	/* check packet length */
 	if(packet_length > packet_len)
+	{
+		ethernet_drop(ethernet_drop_ip);
 		return 0;
+	}
 
 	/* do not support fragmentation */
 	if(ntoh16(header->ffo.flags) & (IP_FLAGS_MORE_FRAGMENTS << 13) || ntoh16(header->ffo.fragment_offset) & 0x1fff)
+	{
+		ethernet_drop(ethernet_drop_ip);
 		return 0;
+	}
 
 	/* check destination ip address */
 	if(memcmp(&header->dst,ip_get_addr(),sizeof(ip_address)))
@@ -267,12 +305,18 @@ uint8_t ip_handle_packet(struct ip_header * header, uint16_t packet_len,const et
 			header->dst[1] != 0xff ||
 			header->dst[2] != 0xff ||
 			header->dst[3] != 0xff)
+		{
+			ethernet_drop(ethernet_drop_ip);
 			return 0;
+		}
 	}
 
 	/* check checksum */
-	if(ntoh16(header->checksum) != (~net_get_checksum(0,(const uint8_t*)header,header_length,10)))
+	if(ntoh16(header->checksum) != (uint16_t)~net_get_checksum(0,(const uint8_t*)header,header_length,10))
+	{
+		ethernet_drop(ethernet_drop_checksum);
 		return 0;
+	}
 
 	/* add to arp table if ip does not exist */
 	arp_table_insert((const ip_address*)&header->src,mac);
@@ -340,6 +384,32 @@ uint8_t ip_in_subnet(const ip_address * ip_remote)
 	return 1;
 }
 
+/**
+ *
+ */
+void ip_set_header_template(void)
+{
+	struct ip_header * ip = &ip_header_template;
+	
+	/* clear ip header */
+	memset(ip,0,sizeof(struct ip_header));
+	
+	/* set version */
+	ip->vihl.version = (IP_V4)<<4;
+	
+	/* set header length */
+	ip->vihl.header_length |= (sizeof(struct ip_header) / 4) & 0xf;
+	
+	/* set time to live */
+	ip->ttl = 64;
+	
+	/* set src addr */
+	memcpy(&ip->src,ip_get_addr(),sizeof(ip_address));
+	
+	/* compute checksum */
+	ip->checksum = hton16(~net_get_checksum(0,(const uint8_t*)ip,sizeof(struct ip_header),10));
+}
+
 /**
  *
  */
@@ -36,11 +36,22 @@ const ip_address * ip_get_gateway(void);
 
 uint8_t ip_send_packet(const ip_address * ip_dst,uint8_t protocol,uint16_t length);
 
+/**
+ * Sends a packet of which only the first buffered bytes are in the
+ * buffer, the rest is already in the transmit buffer of the controller.
+ */
+uint8_t ip_send_frame(const ip_address * ip_dst,uint8_t protocol,uint16_t length,uint16_t buffered);
+
 /**
  *
  */
 uint8_t ip_handle_packet(struct ip_header * header, uint16_t packet_len,const ethernet_address * mac );
 
+/**
+ * Tells the upper layers the link is down
+ */
+void ip_link_down(void);
+
 
 /**
  *
@@ -13,57 +13,96 @@ uint32_t hton32(uint32_t h)
 	return HTON32(h);
 }
 
-#define NET_ROLAND_CHECKSUM		1
+/* One's complement addition of a partial sum */
+uint16_t net_add_checksum(uint16_t checksum,uint16_t sum)
+{
+	checksum += sum;
+	if(checksum < sum)
+		++checksum;
+	return checksum;
+}
+
+/*
+  Updates a checksum as stored in a header after a 16 bit word it covers
+  changed from old_word to new_word, RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m')
+*/
+uint16_t net_adjust_checksum(uint16_t checksum,uint16_t old_word,uint16_t new_word)
+{
+	return ~net_add_checksum(net_add_checksum(~checksum,~old_word),new_word);
+}
+
+/* Same for a 32 bit field */
+uint16_t net_adjust_checksum32(uint16_t checksum,uint32_t old_field,uint32_t new_field)
+{
+	checksum = net_adjust_checksum(checksum,old_field >> 16,new_field >> 16);
+	return net_adjust_checksum(checksum,old_field,new_field);
+}
+
+/*
+  Sums big endian 16 bit words into a 32 bit accumulator, a trailing odd
+  byte counts as high byte. The carries are folded once at the end, which
+  gives the same result as adding them back word by word.
+*/
+static uint32_t net_sum(const uint8_t * data,uint16_t len)
+{
+	uint32_t sum = 0;
+#if defined(__AVR__)
+	/* blocks of at most 256 words keep the sum within 24 bits */
+	while(len >= 4)
+	{
+		uint8_t pairs = (len >= 512) ? 128 : (len >> 2);
+		uint8_t lo = 0, hi = 0, ext = 0, t0, t1;
+		len -= (uint16_t)pairs << 2;
+		/* 17 cycles per 4 bytes */
+		__asm__ __volatile__(
+			"1:"				"\n\t"
+			"ld %[t0], %a[p]+"		"\n\t"
+			"ld %[t1], %a[p]+"		"\n\t"
+			"add %[lo], %[t1]"		"\n\t"
+			"adc %[hi], %[t0]"		"\n\t"
+			"adc %[ext], __zero_reg__"	"\n\t"
+			"ld %[t0], %a[p]+"		"\n\t"
+			"ld %[t1], %a[p]+"		"\n\t"
+			"add %[lo], %[t1]"		"\n\t"
+			"adc %[hi], %[t0]"		"\n\t"
+			"adc %[ext], __zero_reg__"	"\n\t"
+			"dec %[n]"			"\n\t"
+			"brne 1b"			"\n\t"
+			: [lo] "+r" (lo), [hi] "+r" (hi), [ext] "+r" (ext),
+			  [t0] "=&r" (t0), [t1] "=&r" (t1),
+			  [p] "+e" (data), [n] "+r" (pairs)
+			:
+			: "memory"
+		);
+		sum += ((uint32_t)ext << 16) | ((uint16_t)hi << 8) | lo;
+	}
+#endif
+	for(; len > 1; len -= 2, data += 2)
+		sum += ((uint16_t)data[0] << 8) | data[1];
+	if(len > 0)
+		sum += (uint16_t)data[0] << 8;
+	return sum;
+}
+
+/*
+  One's complement sum of data added to checksum, the word at the even
+  offset skip (a checksum field within the data) is left out.
+*/
 uint16_t net_get_checksum(uint16_t checksum,const uint8_t * data,uint16_t len,uint8_t skip)
 {
-#if NET_ROLAND_CHECKSUM
 	if(len < 1)
 		return checksum;
-	
-	const uint8_t * data_skip = data + skip;
-	const uint8_t * data_end = data + len-1;
-	
-	uint16_t temp;
-	
-	for(;data < data_end; data+=2)
-	{
-		/* skip checksum bytes within the data (for checksum plain within the data)*/
-		if(data == data_skip)
-			continue;
-		temp = ((((uint16_t)data[0]) << 8) | (uint16_t)data[1]);
-		checksum += temp;
-		if(checksum < temp)
-			++checksum;
-	}
-	/* last byte*/
-	if(data == data_end)
+	uint32_t sum = checksum;
+	if(!(skip & 1) && skip + 1 < len)
 	{
-		temp = ((uint16_t)(*data_end)) << 8;
-		checksum += temp;
-		if(checksum < temp)
-			++checksum;	
+		sum += net_sum(data,skip);
+		sum += net_sum(data + skip + 2,len - skip - 2);
 	}
-	return checksum;
-#else
-	if(len < 1)
-		return checksum;
-	const uint8_t * data_skip = &data[skip];
-	uint16_t temp;
-	uint32_t sum=0;
-	while(len > 1)
+	else
 	{
-		if(data != data_skip)
-		{
-			temp = MAKEUINT16((*data),*(data+1));
-			sum += temp;
-		}
-		data+=2;
-		len -= 2;
+		sum += net_sum(data,len);
 	}
-	if(len > 0)
-		sum += (*data);
-	while((temp = (sum>>16)))
-		sum = (sum & 0xffff) + temp;
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
 	return (uint16_t)sum;
-#endif
 }
@@ -15,10 +15,10 @@
 #define HTON16(val) (val)
 #define HTON32(val) (val)
 #else
-#define HTON16(val) 	(						\
+#define HTON16(val) 	((uint16_t) (					\
 			(((uint16_t) (val)) << 8) | 			\
 			(((uint16_t) (val)) >> 8)	 		\
-			)
+			))
 #define HTON32(val) 	(						\
 			((((uint32_t) (val)) & 0x000000ff) << 24) |	\
 			((((uint32_t) (val)) & 0x0000ff00) <<	8) | 	\
@@ -40,6 +40,9 @@ uint32_t 	hton32(uint32_t h);
 #define MAKEUINT16(x,y) 	(((x)<<8)|(y)) 
 
 uint16_t net_get_checksum(uint16_t checksum,const uint8_t * data,uint16_t len,uint8_t skip);
+uint16_t net_add_checksum(uint16_t checksum,uint16_t sum);
+uint16_t net_adjust_checksum(uint16_t checksum,uint16_t old_word,uint16_t new_word);
+uint16_t net_adjust_checksum32(uint16_t checksum,uint32_t old_field,uint32_t new_field);
 
 
 
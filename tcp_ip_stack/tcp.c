@@ -16,6 +16,7 @@
 #include "../debug.h"
 
 #include <timer.h>
+#include <util/atomic.h>
 
 /* TCP Flags:
 * URG:	Urgent Pointer field significant
@@ -120,35 +121,183 @@ struct tcp_tcb
 	ip_address ip_remote;
 	uint32_t ack;
 	uint32_t seq;
-	uint16_t seq_next;
 	uint16_t window;
 	uint16_t mss;
 	int8_t rtx;
-  uint8_t* RxData;
-  uint16_t RxLength;
-  uint8_t* TxData;
-  uint16_t TxLength;
+	uint8_t flags;
+	/* sequence number of the first byte of the current reply */
+	uint32_t tx_base;
+	/* reply bytes acknowledged by the peer */
+	uint16_t tx_acked;
+	/* length of the current reply as written by the application */
+	uint16_t tx_total;
+	/* highest reply offset sent so far, including our FIN */
+	uint16_t tx_high;
+	/* retransmission timeout and round trip estimate in ms,
+	   srtt is scaled by 8 and rttvar by 4 */
+	uint16_t rto;
+	uint16_t srtt;
+	uint16_t rttvar;
+	/* timer tick and reply offset of the segment being timed */
+	uint16_t rtt_start;
+	uint16_t rtt_offset;
+	/* right edge of the receive window last advertised, the window never
+	   exceeds TCP_RX_WINDOW so the low half of the sequence number will do */
+	uint16_t rcv_adv;
 	timer_t timer;
+	/* listening socket this connection was spawned from, TCP_PARENT_NONE
+	   if owned by the user, TCP_PARENT_GONE once the listener is freed */
+	tcp_socket_t parent;
+	/* next socket in the same demultiplexing bucket, -1 ends the chain */
+	tcp_socket_t hash_next;
+	/* listening socket: spawned connections still in SYN received */
+	uint8_t backlog;
+	/* set by the timer interrupt, serviced by tcp_poll() */
+	volatile uint8_t expired;
 };
 
 
 
+/* TCB flags */
+#define TCP_TCB_CLOSE		0x01	/* send FIN once the reply is out */
+#define TCP_TCB_FIN_SENT	0x02
+#define TCP_TCB_RTT		0x04	/* a round trip measurement is running */
+#define TCP_TCB_ACK_PENDING	0x08	/* received data not acknowledged yet */
+
+/* parent of a socket that was not spawned from a listening socket */
+#define TCP_PARENT_NONE		-1
+/* parent of a spawned connection whose listening socket was freed */
+#define TCP_PARENT_GONE		-2
+
 static struct tcp_tcb tcp_tcbs[TCP_MAX_SOCKETS];
 
+/* Replies are not buffered. Whenever a segment has to be sent the
+   application writes its whole reply again and only the part of the
+   stream that falls into the segment is copied into the transmit
+   buffer of the controller, summing it up on the way. */
+static struct
+{
+	tcp_socket_t socket;
+	/* stream offset of the segment */
+	uint16_t skip;
+	/* segment length */
+	uint16_t limit;
+	/* bytes copied into the segment */
+	uint16_t length;
+	/* stream bytes written by the application */
+	uint16_t count;
+	/* one's complement sum of the segment data */
+	uint16_t checksum;
+} tcp_tx = {-1,0,0,0,0,0};
+
+/* Request data is handed to one application at a time, only while its
+   callback runs. */
+static struct
+{
+	tcp_socket_t socket;
+	uint8_t * data;
+	uint16_t length;
+} tcp_rx = {-1,0,0};
+
+/* heads of the 4-tuple demultiplexing chains, listening sockets are hashed
+   with the wildcard remote address and port */
+static tcp_socket_t tcp_hash[TCP_HASH_SIZE];
+static const ip_address tcp_ip_any = {0,0,0,0};
+
+/* Initial sequence numbers double as SYN cookies:
+   | counter:5 | mss index:3 | hash:24 |
+   The counter advances every 2048 timer ticks (20 s), a cookie is
+   accepted for one more period. */
+#define TCP_COOKIE_COUNTER(ticks)	((uint8_t)((ticks)>>11) & 0x1F)
+#define TCP_COOKIE_HASH_MASK		0x00FFFFFFUL
+static const uint16_t tcp_cookie_mss[] PROGMEM = {536,1024,1220,TCP_MSS};
+/* one key per counter period, the key of the period before stays
+   valid as long as its cookies do */
+static uint32_t tcp_secret[2];
+/* period tcp_secret[tcp_secret_counter & 1] was drawn for */
+static uint8_t tcp_secret_counter;
+static uint8_t tcp_secret_valid;
+/* stirred with timer 1 at every SYN and with tcp_add_entropy() */
+static uint32_t tcp_entropy;
+
+/* one timer shared by all connections owing an ACK */
+#define TCP_DELACK_IDLE		0
+#define TCP_DELACK_ARMED	1
+#define TCP_DELACK_EXPIRED	2
+static timer_t tcp_delack_timer = TIMER_INVALID;
+static volatile uint8_t tcp_delack_state;
+
+/* Closed connections, the TCB is reused at once. Only what is needed to
+   acknowledge a retransmitted FIN is kept, our sequence number is taken
+   from the peer's ACK. */
+struct tcp_time_wait
+{
+	ip_address ip_remote;
+	uint16_t port_local;
+	/* zero marks an unused slot */
+	uint16_t port_remote;
+	/* timer ticks */
+	uint16_t expiry;
+	uint32_t ack;
+};
+static struct tcp_time_wait tcp_time_waits[TCP_TIME_WAIT_SLOTS];
+
 #define FOREACH_TCB(tcb) for(tcb = &tcp_tcbs[0] ; tcb < &tcp_tcbs[TCP_MAX_SOCKETS] ; tcb++)
 
 static void tcp_print_packet(const struct tcp_header * tcp, uint16_t length);
-static uint8_t 	tcp_send_packet(struct tcp_tcb * tcb,uint8_t flags,uint8_t send_data);
+static uint8_t 	tcp_send_packet(struct tcp_tcb * tcb,uint8_t flags,uint16_t data_length);
+static uint8_t 	tcp_send_segment(const ip_address * ip_remote,uint16_t port_local,uint16_t port_remote,uint32_t seq,uint32_t ack,uint8_t flags,uint16_t window,uint16_t data_length);
+static void	tcp_send_data(struct tcp_tcb * tcb,uint16_t data_length);
+static void	tcp_output(struct tcp_tcb * tcb);
+static uint16_t	tcp_capture(struct tcp_tcb * tcb,uint16_t offset,uint16_t limit,enum tcp_event event);
+static void	tcp_stream(const uint8_t * data,uint16_t length,uint8_t progmem);
+static uint16_t	tcp_get_mss(struct tcp_tcb * tcb);
+static uint8_t	tcp_outstanding(struct tcp_tcb * tcb);
+static void	tcp_retransmit(struct tcp_tcb * tcb);
+static void	tcp_rtt_sample(struct tcp_tcb * tcb);
+static int16_t	tcp_idle_timeout(struct tcp_tcb * tcb);
+static uint16_t	tcp_get_window(struct tcp_tcb * tcb);
+static uint8_t 	tcp_input(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
+static uint8_t 	tcp_fast_path(struct tcp_tcb * tcb,const struct tcp_header * tcp,uint16_t length);
 static uint8_t 	tcp_state_machine(struct tcp_tcb * tcb,const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
+static uint16_t	tcp_receive(struct tcp_tcb * tcb,uint8_t * data,uint16_t * data_length);
+static uint16_t	tcp_message(struct tcp_tcb * tcb,enum tcp_event event);
+static void	tcp_ack_owed(struct tcp_tcb * tcb,uint8_t now);
+static uint8_t 	tcp_accept(struct tcp_tcb * listener,const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
+static uint32_t	tcp_cookie(const ip_address * ip_remote,uint16_t port_source,uint16_t port_destination,uint32_t isn_remote,uint8_t counter,uint8_t mss_index);
+#if TCP_SYN_COOKIES
+static uint8_t 	tcp_cookie_accept(struct tcp_tcb * listener,const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
+#endif
 static uint8_t 	tcp_send_rst(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
-static uint8_t 	tcp_get_options(struct tcp_tcb * tcb,const struct tcp_header * tcp,uint16_t length);
+static uint16_t	tcp_get_options(const struct tcp_header * tcp,uint16_t length,uint16_t mss);
 static uint16_t tcp_get_checksum(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
+static uint16_t tcp_get_pseudo_checksum(const ip_address * ip_remote,uint16_t length);
+static void tcp_stream_write(const uint8_t * data,uint16_t length);
+static uint8_t tcp_stream_clip(uint16_t * skip,uint16_t * length);
+#if NET_CHECKSUM_OFFLOAD
+static void tcp_stream_cached(const struct tcp_cache * cache);
+#endif
 static tcp_socket_t tcp_get_socket_num(struct tcp_tcb * tcb);  
 static uint8_t tcp_socket_valid(tcp_socket_t socket);
 static uint8_t tcp_tcb_valid(struct tcp_tcb * tcb);
 static uint8_t tcp_free_port(uint16_t port);
+static uint16_t tcp_ephemeral_port(void);
+static void tcp_seed(void);
+static uint8_t 	tcp_syn_sent(struct tcp_tcb * tcb,const struct tcp_header * tcp);
 static void tcp_tcb_free(struct tcp_tcb * tcb);
+static void tcp_tcb_release(struct tcp_tcb * tcb,enum tcp_event event);
+static struct tcp_tcb * tcp_tcb_spawn(struct tcp_tcb * listener);
+static void tcp_time_wait_enter(struct tcp_tcb * tcb);
+static uint8_t tcp_time_wait_handle(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
 static void tcp_timeout(timer_t timer,void * arg);
+static void tcp_timer_set(struct tcp_tcb * tcb,int16_t ms);
+static void tcp_timer_stop(struct tcp_tcb * tcb);
+static void tcp_delack_timeout(timer_t timer,void * arg);
+static void tcp_delack_start(struct tcp_tcb * tcb);
+static uint8_t tcp_hash_key(const ip_address * ip_remote,uint16_t port_local,uint16_t port_remote);
+static void tcp_hash_insert(struct tcp_tcb * tcb);
+static void tcp_hash_remove(struct tcp_tcb * tcb);
+static struct tcp_tcb * tcp_lookup(const ip_address * ip_remote,uint16_t port_local,uint16_t port_remote);
 
   
 static void tcp_print_packet(const struct tcp_header * tcp, uint16_t length){
@@ -174,7 +323,19 @@ static void tcp_print_packet(const struct tcp_header * tcp, uint16_t length){
   
 uint8_t tcp_init(void)
 {
+  struct tcp_tcb * tcb;
   memset(tcp_tcbs,0,sizeof(tcp_tcbs));
+  FOREACH_TCB(tcb)
+  {
+    tcb->timer = TIMER_INVALID;
+    tcb->parent = TCP_PARENT_NONE;
+    tcb->hash_next = -1;
+  }
+  memset(tcp_hash,-1,sizeof(tcp_hash));
+  memset(tcp_time_waits,0,sizeof(tcp_time_waits));
+  if(tcp_delack_timer == TIMER_INVALID)
+    tcp_delack_timer = timer_alloc(tcp_delack_timeout,TCP_DELAYED_ACK_MS);
+  tcp_delack_state = TCP_DELACK_IDLE;
   return 1;
 }
 
@@ -191,6 +352,7 @@ tcp_socket_t tcp_socket_alloc(tcp_socket_callback callback)
       continue;
     tcb->state = tcp_state_closed;
     tcb->callback = callback;
+    tcb->parent = TCP_PARENT_NONE;
     break;
   }
   return socket_num;
@@ -206,122 +368,843 @@ uint8_t tcp_listen(tcp_socket_t socket,uint16_t port)
   if(tcb->state != tcp_state_closed)
     return 0;
   tcb->port_local = port;
+  tcb->port_remote = TCP_PORT_ANY;
+  memcpy(&tcb->ip_remote,&tcp_ip_any,sizeof(ip_address));
+  tcb->backlog = 0;
   tcb->state = tcp_state_listen;
-  tcb->timer = timer_alloc(tcp_timeout, TCP_TIMEOUT_MS);
-  timer_set_arg(tcb->timer,(void*)tcb);
+  tcp_hash_insert(tcb);
   return 1;
 }
 
+/* Active open, the socket gets tcp_event_connection_established or
+   tcp_event_timeout after TCP_RTX_SYN retries */
+uint8_t tcp_connect(tcp_socket_t socket,const ip_address * ip_remote,uint16_t port)
+{
+  if(!tcp_socket_valid(socket) || !ip_remote)
+    return 0;
+  struct tcp_tcb * tcb = &tcp_tcbs[socket];
+  if(tcb->state != tcp_state_closed)
+    return 0;
+  if(tcb->timer == TIMER_INVALID)
+  {
+    tcb->timer = timer_alloc(tcp_timeout,TCP_TIMEOUT_MS);
+    if(tcb->timer == TIMER_INVALID)
+      return 0;
+    timer_set_arg(tcb->timer,(void*)tcb);
+  }
+  tcb->expired = 0;
+  memcpy(tcb->ip_remote,ip_remote,sizeof(ip_address));
+  tcb->port_remote = port;
+  tcb->port_local = tcp_ephemeral_port();
+  /* default mss until the SYN, ACK brings the option */
+  tcb->mss = 536;
+  tcp_seed();
+  tcb->seq = tcp_cookie(ip_remote,hton16(port),hton16(tcb->port_local),0,TCP_COOKIE_COUNTER(timer_get_ticks()),0);
+  tcb->rto = TCP_RTO_INIT;
+  tcb->state = tcp_state_syn_sent;
+  tcp_hash_insert(tcb);
+  /* lost if the peer's MAC is not known yet, the retransmission follows */
+  tcp_send_packet(tcb,TCP_FLAG_SYN,0);
+  tcb->rtt_start = timer_get_ticks();
+  tcb->flags |= TCP_TCB_RTT;
+  tcp_timer_set(tcb,tcb->rto);
+  return 1;
+}
+
+/* Starts a message on an established connection, the application writes
+   it on tcp_event_data_send. Not possible from a callback or while the
+   last message is not acknowledged. */
+uint8_t tcp_send(tcp_socket_t socket)
+{
+  if(!tcp_socket_valid(socket) || tcp_tx.socket >= 0)
+    return 0;
+  struct tcp_tcb * tcb = &tcp_tcbs[socket];
+  if(tcb->state != tcp_state_established && tcb->state != tcp_state_close_wait)
+    return 0;
+  if(tcb->tx_acked != tcb->tx_total || (tcb->flags & TCP_TCB_CLOSE))
+    return 0;
+  uint16_t segment = tcp_message(tcb,tcp_event_data_send);
+  if(segment > 0)
+    tcp_send_data(tcb,segment);
+  tcp_output(tcb);
+  return 1;
+}
+
+uint8_t tcp_close(tcp_socket_t socket)
+{
+  if(!tcp_socket_valid(socket))
+    return 0;
+  struct tcp_tcb * tcb = &tcp_tcbs[socket];
+  if(tcb->state != tcp_state_established && tcb->state != tcp_state_close_wait)
+    return 0;
+  tcb->flags |= TCP_TCB_CLOSE;
+  /* from a callback the FIN goes out with the reply, otherwise now */
+  if(tcp_tx.socket < 0)
+    tcp_output(tcb);
+  return 1;
+}
+
+#if TCP_BENCHMARK
+/* cycles spent in the fast path [0] and the slow path [1] */
+static struct
+{
+	uint32_t cycles;
+	uint16_t count;
+} tcp_benchmark[2];
+static uint8_t tcp_benchmark_fast;
+
+/* Timer 1 counts CPU cycles / 8 and wraps every tick (OCR1A + 1 counts) */
+uint8_t tcp_handle_packet(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
+{
+  uint16_t ticks = timer_get_ticks();
+  uint16_t start = TCNT1;
+  tcp_benchmark_fast = 0;
+  uint8_t ret = tcp_input(ip_remote,tcp,length);
+  uint16_t end = TCNT1;
+  ticks = timer_get_ticks() - ticks;
+  uint32_t cycles = ((uint32_t)ticks * (OCR1A + 1) + end - start) * 8;
+  uint8_t path = tcp_benchmark_fast ? 0 : 1;
+  tcp_benchmark[path].cycles += cycles;
+  if(++tcp_benchmark[path].count == TCP_BENCHMARK)
+  {
+    char buffer[40];
+    sprintf(buffer, "TCP %s path: %" PRIu32 " cycles", path ? "slow" : "fast", tcp_benchmark[path].cycles / TCP_BENCHMARK);
+    DBG_DYNAMIC(buffer);
+    tcp_benchmark[path].cycles = 0;
+    tcp_benchmark[path].count = 0;
+  }
+  return ret;
+}
+#else
 uint8_t tcp_handle_packet(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
+{
+  return tcp_input(ip_remote,tcp,length);
+}
+#endif
+
+uint8_t tcp_input(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
 {
   //tcp_print_packet(tcp, length);
   if(length < sizeof(struct tcp_header))
     return 0;
-  if(ntoh16(tcp->checksum) != tcp_get_checksum(ip_remote,tcp,length))
+  /* summed with its checksum field a valid segment gives 0xffff */
+  if(ethernet_rx_checksum(tcp_get_pseudo_checksum(ip_remote,length),(const uint8_t*)tcp,length) != 0xffff)
+  {
+    ethernet_drop(ethernet_drop_checksum);
     return 0;
-  struct tcp_tcb * tcb;
-  struct tcp_tcb * tcb_selected = 0;
-  FOREACH_TCB(tcb)
-  { 
-    if(tcb->state == tcp_state_unused)
-      continue;
-    if(tcb->port_local != ntoh16(tcp->port_destination))
-      continue;
-    if(tcb->state == tcp_state_listen || tcb->state == tcp_state_closed)
-    {
-      tcb_selected = tcb;
-      continue;
-    }
-    if(tcb->port_remote != ntoh16(tcp->port_source))
-      continue;
-    if(memcmp(&tcb->ip_remote,ip_remote,sizeof(ip_address)))
-      continue;
-    tcb_selected = tcb;
-    break;
   }
-  if(tcb_selected != 0)
-    return tcp_state_machine(tcb_selected,ip_remote,tcp,length); 
+  uint16_t port_local = ntoh16(tcp->port_destination);
+  uint16_t port_remote = ntoh16(tcp->port_source);
+  struct tcp_tcb * tcb = tcp_lookup(ip_remote,port_local,port_remote);
+  if(tcb != 0)
+  {
+    if(tcp_fast_path(tcb,tcp,length))
+      return 1;
+    if(!(tcp->flags & TCP_FLAG_SYN) || tcb->state == tcp_state_syn_received || tcb->state == tcp_state_syn_sent)
+      return tcp_state_machine(tcb,ip_remote,tcp,length);
+    /* peer reuses the 4-tuple of a stale connection, replace it */
+    tcp_tcb_release(tcb,tcp_event_reset);
+  }
+  else if(tcp_time_wait_handle(ip_remote,tcp,length))
+  {
+    return 1;
+  }
+  tcb = tcp_lookup(&tcp_ip_any,port_local,TCP_PORT_ANY);
+  if(tcb != 0)
+    return tcp_accept(tcb,ip_remote,tcp,length);
+  ethernet_drop(ethernet_drop_port);
   tcp_send_rst(ip_remote,tcp,length);
   return 0;
 }
 
+uint8_t tcp_accept(struct tcp_tcb * listener,const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
+{
+  if(tcp->flags & TCP_FLAG_RST)
+    return 0;
+#if TCP_SYN_COOKIES
+  if((tcp->flags & (TCP_FLAG_SYN|TCP_FLAG_ACK)) == TCP_FLAG_ACK)
+  {
+    /* may complete a handshake answered with a cookie */
+    if(tcp_cookie_accept(listener,ip_remote,tcp,length))
+      return 1;
+  }
+#endif
+  /* only a SYN may open a connection, anything else is a stray segment */
+  if(!(tcp->flags & TCP_FLAG_SYN) || (tcp->flags & TCP_FLAG_ACK))
+  {
+    tcp_send_rst(ip_remote,tcp,length);
+    return 0;
+  }
+  tcp_add_entropy(0);
+  tcp_seed();
+  uint32_t isn_remote = ntoh32(tcp->seq);
+  struct tcp_tcb * tcb = (listener->backlog < TCP_SYN_BACKLOG) ? tcp_tcb_spawn(listener) : 0;
+  if(!tcb)
+  {
+#if TCP_SYN_COOKIES
+    /* keep no state, the peer's ACK brings everything back and
+       tcp_cookie_accept() builds the connection in a free TCB */
+    uint16_t mss = tcp_get_options(tcp,length,536);
+    uint8_t mss_index = sizeof(tcp_cookie_mss)/sizeof(tcp_cookie_mss[0]) - 1;
+    while(mss_index > 0 && pgm_read_word(&tcp_cookie_mss[mss_index]) > mss)
+      mss_index--;
+    uint32_t cookie = tcp_cookie(ip_remote,tcp->port_source,tcp->port_destination,isn_remote,TCP_COOKIE_COUNTER(timer_get_ticks()),mss_index);
+    /* the reply overwrites the received headers */
+    ip_address ip;
+    memcpy(ip,ip_remote,sizeof(ip_address));
+    DBG_STATIC("TCP backlog full, sending cookie.");
+    return tcp_send_segment((const ip_address*)&ip,listener->port_local,ntoh16(tcp->port_source),cookie,isn_remote + 1,TCP_FLAG_SYN|TCP_FLAG_ACK,TCP_RX_WINDOW,0);
+#else
+    /* backlog full, drop the SYN and let the peer retransmit it */
+    DBG_STATIC("TCP backlog full.");
+    return 0;
+#endif
+  }
+  tcp_socket_t socket = tcp_get_socket_num(tcb);
+  /* set remote ip address */
+  memcpy(tcb->ip_remote,ip_remote,sizeof(ip_address));
+  tcb->port_remote = ntoh16(tcp->port_source);
+  /* default mss if the peer does not send the option (RFC 1122) */
+  tcb->mss = tcp_get_options(tcp,length,536);
+  /* set ack */
+  tcb->ack = isn_remote + 1;
+  /* an unpredictable initial sequence number, computed like a cookie */
+  tcb->seq = tcp_cookie(ip_remote,tcp->port_source,tcp->port_destination,isn_remote,TCP_COOKIE_COUNTER(timer_get_ticks()),0);
+  tcb->state = tcp_state_syn_received;
+  tcb->rto = TCP_RTO_INIT;
+  listener->backlog++;
+  tcp_hash_insert(tcb);
+  /* Send information to user about incoming new connection */
+  tcb->callback(socket,tcp_event_connection_incoming);
+  /* send SYN, ACK segment and time its round trip */
+  tcp_send_packet(tcb,TCP_FLAG_SYN|TCP_FLAG_ACK,0);
+  tcb->rtt_start = timer_get_ticks();
+  tcb->flags |= TCP_TCB_RTT;
+  tcp_timer_set(tcb,tcb->rto);
+  return 1;
+}
+
+/* Mixes noise and the cycle count of timer 1 into the entropy pool, the
+   low bits of TCNT1 at the arrival of a segment depend on the peer */
+void tcp_add_entropy(uint16_t noise)
+{
+  tcp_entropy += noise ^ ((uint32_t)TCNT1<<16);
+  tcp_entropy += tcp_entropy<<10;
+  tcp_entropy ^= tcp_entropy>>6;
+}
+
+/* Draws a new key from the pool whenever the cookie counter advances,
+   the key of two periods ago has no valid cookies left */
+void tcp_seed(void)
+{
+  uint8_t counter = TCP_COOKIE_COUNTER(timer_get_ticks());
+  if(tcp_secret_valid && counter == tcp_secret_counter)
+    return;
+  uint8_t keys = (tcp_secret_valid && ((counter - tcp_secret_counter) & 0x1F) == 1) ? 1 : 2;
+  while(keys--)
+  {
+    tcp_add_entropy(counter);
+    uint32_t key = tcp_entropy;
+    key += key<<3;
+    key ^= key>>11;
+    key += key<<15;
+    tcp_secret[(counter - keys) & 1] = key;
+  }
+  tcp_secret_counter = counter;
+  tcp_secret_valid = 1;
+}
+
+/* Keyed one-at-a-time hash of the connection and the peer's ISN */
+uint32_t tcp_cookie(const ip_address * ip_remote,uint16_t port_source,uint16_t port_destination,uint32_t isn_remote,uint8_t counter,uint8_t mss_index)
+{
+  struct
+  {
+    ip_address ip;
+    uint16_t port_source;
+    uint16_t port_destination;
+    uint32_t isn;
+    uint8_t counter;
+  } key;
+  memset(&key,0,sizeof(key));
+  memcpy(key.ip,ip_remote,sizeof(ip_address));
+  key.port_source = port_source;
+  key.port_destination = port_destination;
+  key.isn = isn_remote;
+  key.counter = counter;
+  const uint8_t * data = (const uint8_t*)&key;
+  uint32_t hash = tcp_secret[counter & 1];
+  uint8_t i;
+  for(i = 0 ; i < sizeof(key) ; i++)
+  {
+    hash += data[i];
+    hash += hash<<10;
+    hash ^= hash>>6;
+  }
+  hash += hash<<3;
+  hash ^= hash>>11;
+  hash += hash<<15;
+  return ((uint32_t)counter<<27) | ((uint32_t)mss_index<<24) | (hash & TCP_COOKIE_HASH_MASK);
+}
+
+#if TCP_SYN_COOKIES
+/* Opens an established connection from the ACK answering a cookie */
+uint8_t tcp_cookie_accept(struct tcp_tcb * listener,const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
+{
+  tcp_seed();
+  uint32_t cookie = ntoh32(tcp->ack) - 1;
+  uint32_t isn_remote = ntoh32(tcp->seq) - 1;
+  uint8_t counter = (uint8_t)(cookie>>27);
+  uint8_t mss_index = (uint8_t)(cookie>>24) & 0x07;
+  if(((TCP_COOKIE_COUNTER(timer_get_ticks()) - counter) & 0x1F) > 1)
+    return 0;
+  if(mss_index >= sizeof(tcp_cookie_mss)/sizeof(tcp_cookie_mss[0]))
+    return 0;
+  if(tcp_cookie(ip_remote,tcp->port_source,tcp->port_destination,isn_remote,counter,mss_index) != cookie)
+    return 0;
+  struct tcp_tcb * tcb = tcp_tcb_spawn(listener);
+  if(!tcb)
+    return 0;
+  tcp_socket_t socket = tcp_get_socket_num(tcb);
+  memcpy(tcb->ip_remote,ip_remote,sizeof(ip_address));
+  tcb->port_remote = ntoh16(tcp->port_source);
+  tcb->mss = pgm_read_word(&tcp_cookie_mss[mss_index]);
+  tcb->ack = isn_remote + 1;
+  tcb->seq = cookie + 1;
+  tcb->tx_base = tcb->seq;
+  tcb->rto = TCP_RTO_INIT;
+  tcb->state = tcp_state_established;
+  tcp_hash_insert(tcb);
+  DBG_STATIC("TCP cookie accepted.");
+  tcb->callback(socket,tcp_event_connection_incoming);
+  tcb->callback(socket,tcp_event_connection_established);
+  tcp_timer_set(tcb,TCP_TIMEOUT_IDLE);
+  /* the ACK may already carry the request */
+  return tcp_state_machine(tcb,ip_remote,tcp,length);
+}
+#endif
+
+/* Header prediction (Van Jacobson): on an established connection the next
+   segment in order, with only ACK (and PSH) set and no options, is either
+   an ACK for part of the reply or a new request. Returns 0 when the
+   segment needs the state machine. */
+uint8_t tcp_fast_path(struct tcp_tcb * tcb,const struct tcp_header * tcp,uint16_t length)
+{
+  if(tcb->state != tcp_state_established)
+    return 0;
+  if((tcp->flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK || tcp->offset != (sizeof(struct tcp_header)/4)<<4)
+    return 0;
+  if(ntoh32(tcp->seq) != tcb->ack)
+    return 0;
+  uint16_t data_length = length - sizeof(struct tcp_header);
+  uint16_t acked = (uint16_t)(ntoh32(tcp->ack) - tcb->tx_base);
+  if(data_length == 0)
+  {
+    /* new bytes acknowledged, but not the end of the reply */
+    if(acked <= tcb->tx_acked || acked >= tcb->tx_total || acked > (uint16_t)(tcb->seq - tcb->tx_base))
+      return 0;
+    tcb->window = ntoh16(tcp->window);
+    tcb->tx_acked = acked;
+    if((tcb->flags & TCP_TCB_RTT) && acked >= tcb->rtt_offset)
+      tcp_rtt_sample(tcb);
+    tcb->rtx = 0;
+    tcp_timer_set(tcb,tcp_outstanding(tcb) ? tcb->rto : tcp_idle_timeout(tcb));
+    tcp_output(tcb);
+  }
+  else
+  {
+    /* a request, the last reply is completely acknowledged */
+    if(acked != tcb->tx_acked || tcb->tx_acked != tcb->tx_total)
+      return 0;
+    tcb->window = ntoh16(tcp->window);
+    uint8_t ack_now = (tcb->flags & TCP_TCB_ACK_PENDING);
+    tcb->flags |= TCP_TCB_ACK_PENDING;
+    uint16_t segment = tcp_receive(tcb,(uint8_t*)tcp + sizeof(struct tcp_header),&data_length);
+    if(segment > 0)
+      tcp_send_data(tcb,segment);
+    if(!tcp_outstanding(tcb))
+      tcp_timer_set(tcb,tcp_idle_timeout(tcb));
+    tcp_output(tcb);
+    tcp_ack_owed(tcb,ack_now);
+  }
+#if TCP_BENCHMARK
+  tcp_benchmark_fast = 1;
+#endif
+  return 1;
+}
+
+/* Hands request data to the application as it is read from the controller
+   into the window behind the headers, until the application replies. The
+   rest is left for the peer to retransmit, data_length is set to the bytes
+   taken. Returns the length of the first reply segment captured. */
+uint16_t tcp_receive(struct tcp_tcb * tcb,uint8_t * data,uint16_t * data_length)
+{
+  uint16_t taken = 0;
+  uint16_t segment = 0;
+  tcp_rx.socket = tcp_get_socket_num(tcb);
+  tcp_rx.data = data;
+  while(taken < *data_length)
+  {
+    tcp_rx.length = ethernet_rx_window(data,taken,*data_length - taken);
+    if(tcp_rx.length == 0)
+      break;
+    tcb->ack += tcp_rx.length;
+    taken += tcp_rx.length;
+    segment = tcp_message(tcb,tcp_event_data_received);
+    if(tcb->tx_total > 0)
+      break;
+  }
+  tcp_rx.socket = -1;
+  *data_length = taken;
+  return segment;
+}
+
+/* A reply or a pushed message begins, the application writes it for the
+   first time, returns the length of the first segment captured */
+uint16_t tcp_message(struct tcp_tcb * tcb,enum tcp_event event)
+{
+  tcb->tx_base = tcb->seq;
+  tcb->tx_acked = 0;
+  tcb->tx_total = 0;
+  tcb->tx_high = 0;
+  uint16_t segment = tcp_get_mss(tcb);
+  if(segment > tcb->window)
+    segment = tcb->window;
+  segment = tcp_capture(tcb,0,segment,event);
+  tcb->tx_total = tcp_tx.count;
+  return segment;
+}
+
+/* The answer to our SYN */
+uint8_t tcp_syn_sent(struct tcp_tcb * tcb,const struct tcp_header * tcp)
+{
+  if(!(tcp->flags & TCP_FLAG_ACK) || ntoh32(tcp->ack) != tcb->seq + 1)
+    return 0;
+  if(tcp->flags & TCP_FLAG_RST)
+  {
+    /* connection refused */
+    tcp_tcb_release(tcb,tcp_event_reset);
+    return 1;
+  }
+  if(!(tcp->flags & TCP_FLAG_SYN))
+    return 0;
+  tcb->seq++;
+  tcb->tx_base = tcb->seq;
+  tcb->ack = ntoh32(tcp->seq) + 1;
+  tcb->window = ntoh16(tcp->window);
+  tcp_rtt_sample(tcb);
+  tcb->rtx = 0;
+  tcb->state = tcp_state_established;
+  tcp_timer_stop(tcb);
+  /* a message started from the callback carries the ACK of the handshake */
+  tcb->flags |= TCP_TCB_ACK_PENDING;
+  tcb->callback(tcp_get_socket_num(tcb),tcp_event_connection_established);
+  tcp_ack_owed(tcb,1);
+  return 1;
+}
+
+/* Sends the ACK still owed now or after the delay */
+void tcp_ack_owed(struct tcp_tcb * tcb,uint8_t now)
+{
+  if(!(tcb->flags & TCP_TCB_ACK_PENDING))
+    return;
+  if(now)
+    tcp_send_packet(tcb,TCP_FLAG_ACK,0);
+  else
+    tcp_delack_start(tcb);
+}
+
 uint8_t tcp_state_machine(struct tcp_tcb * tcb,const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
 {
 	if(!tcb || !ip_remote || !tcp || length < sizeof(struct tcp_header))
 		return 0;
-	tcp_get_options(tcb,tcp,length);
+	tcb->mss = tcp_get_options(tcp,length,tcb->mss);
 	tcp_socket_t socket = tcp_get_socket_num(tcb);
 	if(socket < 0)
 		return 0;
   
-  /*Reset timer*/
-  timer_reset(tcb->timer);
+  if(tcb->state == tcp_state_syn_sent)
+    return tcp_syn_sent(tcb,tcp);
+  
+  if(tcp->flags & TCP_FLAG_RST){
+    tcp_tcb_release(tcb,tcp_event_reset);
+    return 1;
+  }
   
   if(tcp->flags & TCP_FLAG_SYN){
-    /* set remote ip address */
-    memcpy(tcb->ip_remote,ip_remote,sizeof(ip_address));
-    tcb->port_remote = ntoh16(tcp->port_source);
-    /* set mss */
-    tcb->mss = tcb->mss;
-    /* Send information to user about incoming new connection */
-    tcb->callback(socket,tcp_event_connection_incoming);
-    /* User accepted the connection so we have to establish a connection */
-    /* set ack */
-    tcb->ack = ntoh32(tcp->seq) + 1;
-    /* send SYN, ACK segment */
+    /* our SYN, ACK got lost, the peer retransmitted its SYN */
     tcp_send_packet(tcb,TCP_FLAG_SYN|TCP_FLAG_ACK,0);
-    
-    tcb->state = tcp_state_syn_received;
     return 1;
   }
   
-  //Should receive seq which is previous ack number 
-	if(ntoh32(tcp->seq) != tcb->ack)
-	{
-    return 0;
-	}
-  
   /* check ACK field */
   /* if ACK bit is off drop the segment and return */
   if(!(tcp->flags & TCP_FLAG_ACK))
   return 0;
   
-  tcb->seq = ntoh32(tcp->ack);
-  //Either an syn ack or data
-  uint8_t data_offset = (tcp->offset>>4)<<2;
+  /* the reply is built in the same buffer, keep what is needed of the header */
+  uint32_t ack = ntoh32(tcp->ack);
+  uint8_t fin = tcp->flags & TCP_FLAG_FIN;
+  uint16_t data_offset = (tcp->offset>>4)<<2;
   uint16_t data_length = length - data_offset;
-  //Connection established
-  if(data_length == 0){
-    if(tcp->flags & TCP_FLAG_FIN){
-      tcb->ack = ntoh32(tcp->seq) + 1;
-      tcp_send_packet(tcb,TCP_FLAG_FIN|TCP_FLAG_ACK,0);
-      tcb->callback(socket,tcp_event_connection_closing);
-      tcb->state = tcp_state_listen;
-      timer_stop(tcb->timer);
-    } else {
-      tcb->callback(socket,tcp_event_connection_established);
-      tcb->state = tcp_state_established;
+  /* acknowledge at once instead of delayed */
+  uint8_t ack_now = (tcb->flags & TCP_TCB_ACK_PENDING);
+  
+  //Should receive seq which is previous ack number 
+  int32_t early = (int32_t)(tcb->ack - ntoh32(tcp->seq));
+  if(early > 0){
+    if((uint32_t)early > data_length || ((uint32_t)early == data_length && !fin)){
+      /* a retransmission of data we have, our ACK got lost */
+      if(data_length > 0 || fin)
+        tcp_send_packet(tcb,TCP_FLAG_ACK,0);
+      return 0;
     }
+    /* overlaps the end of the data we have, keep the new part */
+    data_offset += early;
+    data_length -= early;
+  } else if(early < 0){
+    if((uint32_t)-early >= (uint16_t)(tcb->rcv_adv - (uint16_t)tcb->ack))
+      return 0;
+    /* there is a hole before this segment, its data is dropped but its ACK
+       counts, a duplicate ACK makes the peer resend the missing segment */
+    if(data_length > 0 || fin)
+      ack_now = 1;
+    data_length = 0;
+    fin = 0;
+  }
+  
+  tcb->window = ntoh16(tcp->window);
+  uint8_t progress = 0;
+  
+  if(tcb->state == tcp_state_syn_received){
+    /* the ACK has to cover our SYN */
+    if(ack != tcb->seq + 1)
+      return 0;
+    tcb->seq++;
+    tcb->tx_base = tcb->seq;
+    tcp_rtt_sample(tcb);
+    tcb->rtx = 0;
+    progress = 1;
+    /* handshake completed, the connection no longer counts against the backlog */
+    tcp_tcbs[tcb->parent].backlog--;
+    tcb->state = tcp_state_established;
+    tcb->callback(socket,tcp_event_connection_established);
   } else {
-    tcb->ack = ntoh32(tcp->seq) + data_length;
-    // if(data_length> TCB_RX_BUFFERSIZE){
-      // data_length = TCB_RX_BUFFERSIZE;
-    // }
-    tcb->RxData = (const uint8_t*)tcp + data_offset;
-    // memcpy(tcb->RxData, (const uint8_t*)tcp + data_offset,data_length);
-    tcb->RxLength = data_length;
-    tcb->callback(socket,tcp_event_data_received);
-    //Send ack
-    tcp_send_packet(tcb,TCP_FLAG_ACK,0);
-    if(tcb->TxLength > 0){
-      //Send ACK and the reply data and FIN
-      tcp_send_packet(tcb, TCP_FLAG_ACK|TCP_FLAG_FIN|TCP_FLAG_PSH, 1);
+    /* bytes of the reply (and our FIN) acknowledged by this segment */
+    uint16_t acked = (uint16_t)(ack - tcb->tx_base);
+    if(acked > tcb->tx_acked && acked <= tcb->tx_high){
+      if(tcb->tx_acked < tcb->tx_total && acked >= tcb->tx_total)
+        tcb->callback(socket,tcp_event_data_acked);
+      tcb->tx_acked = acked;
+      if((tcb->flags & TCP_TCB_RTT) && acked >= tcb->rtt_offset)
+        tcp_rtt_sample(tcb);
+      tcb->rtx = 0;
+      progress = 1;
+      if((uint16_t)(tcb->seq - tcb->tx_base) < acked){
+        /* segments sent before a retransmission timeout got through after all */
+        tcb->seq = tcb->tx_base + acked;
+        if(acked > tcb->tx_total && !(tcb->flags & TCP_TCB_FIN_SENT)){
+          tcb->flags |= TCP_TCB_FIN_SENT;
+          tcb->state = (tcb->state == tcp_state_close_wait) ? tcp_state_last_ack : tcp_state_fin_wait_1;
+        }
+      }
     }
-    tcb->state = tcp_state_listen;
-    timer_stop(tcb->timer);
   }
+  
+  uint16_t segment = 0;
+  if(data_length > 0){
+    if(tcb->state != tcp_state_established || tcb->tx_acked != tcb->tx_total){
+      /* a new request is only taken once the previous reply is out,
+         the peer will retransmit it */
+      data_length = 0;
+      fin = 0;
+    } else {
+      uint16_t taken = data_length;
+      segment = tcp_receive(tcb,(uint8_t*)tcp + data_offset,&taken);
+      /* the peer's FIN only counts once all its data is taken */
+      if(taken < data_length)
+        fin = 0;
+      data_length = taken;
+    }
+  }
+  
+  if(fin){
+    tcb->ack++;
+    switch(tcb->state)
+    {
+    case tcp_state_established:
+      tcb->callback(socket,tcp_event_connection_closing);
+      /* close our side too once the reply is out */
+      tcb->flags |= TCP_TCB_CLOSE;
+      tcb->state = tcp_state_close_wait;
+      break;
+    case tcp_state_fin_wait_1:
+    case tcp_state_fin_wait_2:
+      tcp_send_packet(tcb,TCP_FLAG_ACK,0);
+      tcp_time_wait_enter(tcb);
+      tcp_tcb_release(tcb,tcp_event_connection_closed);
+      return 1;
+    default:
+      break;
+    }
+  }
+  
+  if(data_length > 0 || fin || ack_now){
+    /* the reply or our FIN carries the ACK, otherwise it is delayed,
+       but no more than one segment stays unacknowledged */
+    tcb->flags |= TCP_TCB_ACK_PENDING;
+  }
+  if(segment > 0){
+    //Send the first segment of the reply, captured above
+    tcp_send_data(tcb,segment);
+  }
+  
+  if((tcb->flags & TCP_TCB_FIN_SENT) && tcb->tx_acked == tcb->tx_total + 1){
+    /* our FIN is acknowledged */
+    if(tcb->state == tcp_state_fin_wait_1){
+      tcb->state = tcp_state_fin_wait_2;
+    } else if(tcb->state == tcp_state_last_ack){
+      /* remembered as well, to drop duplicate ACKs quietly */
+      tcp_time_wait_enter(tcb);
+      tcp_tcb_release(tcb,tcp_event_connection_closed);
+      return 1;
+    }
+  }
+  /* the retransmission timer only restarts when the peer makes progress */
+  if(progress || !tcp_outstanding(tcb))
+    tcp_timer_set(tcb,tcp_outstanding(tcb) ? tcb->rto : tcp_idle_timeout(tcb));
+  tcp_output(tcb);
+  tcp_ack_owed(tcb,ack_now);
   return 1;
+}
 
+/* Sends as much of the reply as the peer's window allows */
+void tcp_output(struct tcp_tcb * tcb)
+{
+  while(!(tcb->flags & TCP_TCB_FIN_SENT))
+  {
+    uint16_t sent = (uint16_t)(tcb->seq - tcb->tx_base);
+    uint16_t length = tcb->tx_total - sent;
+    if(length > 0)
+    {
+      uint16_t in_flight = sent - tcb->tx_acked;
+      if(in_flight >= tcb->window)
+        return;
+      if(length > tcb->window - in_flight)
+        length = tcb->window - in_flight;
+      if(length > tcp_get_mss(tcb))
+        length = tcp_get_mss(tcb);
+      length = tcp_capture(tcb,sent,length,(sent < tcb->tx_high) ? tcp_event_data_regenerate : tcp_event_data_send);
+      if(length == 0)
+        return;
+    }
+    else if(!(tcb->flags & TCP_TCB_CLOSE) || tcb->state == tcp_state_syn_received)
+    {
+      return;
+    }
+    tcp_send_data(tcb,length);
+  }
+}
+
+/* Sends the segment captured in the buffer, with FIN if it ends the reply */
+void tcp_send_data(struct tcp_tcb * tcb,uint16_t data_length)
+{
+  uint8_t flags = TCP_FLAG_ACK;
+  if(data_length > 0)
+    flags |= TCP_FLAG_PSH;
+  uint16_t sent = (uint16_t)(tcb->seq - tcb->tx_base);
+  if((tcb->flags & TCP_TCB_CLOSE) && sent + data_length == tcb->tx_total)
+    flags |= TCP_FLAG_FIN;
+  if(sent == tcb->tx_acked)
+  {
+    /* nothing was in flight, start the retransmission timer */
+    tcp_timer_set(tcb,tcb->rto);
+  }
+  if(!(tcb->flags & TCP_TCB_RTT) && data_length > 0 && sent + data_length > tcb->tx_high)
+  {
+    /* time new data only, never a retransmission (Karn) */
+    tcb->rtt_start = timer_get_ticks();
+    tcb->rtt_offset = sent + data_length;
+    tcb->flags |= TCP_TCB_RTT;
+  }
+  tcp_send_packet(tcb,flags,data_length);
+  tcb->seq += data_length;
+  if(flags & TCP_FLAG_FIN)
+  {
+    tcb->seq++;
+    tcb->flags |= TCP_TCB_FIN_SENT;
+    tcb->state = (tcb->state == tcp_state_close_wait) ? tcp_state_last_ack : tcp_state_fin_wait_1;
+  }
+  sent = (uint16_t)(tcb->seq - tcb->tx_base);
+  if(sent > tcb->tx_high)
+    tcb->tx_high = sent;
+}
+
+/* New credit is only given once the reply to the last request is out,
+   until then the window closes as data arrives but never shrinks */
+uint16_t tcp_get_window(struct tcp_tcb * tcb)
+{
+  if(tcb->tx_acked == tcb->tx_total)
+    tcb->rcv_adv = (uint16_t)tcb->ack + TCP_RX_WINDOW;
+  int16_t window = (int16_t)(tcb->rcv_adv - (uint16_t)tcb->ack);
+  return (window > 0) ? (uint16_t)window : 0;
+}
+
+/* Kept alive connections wait longer for the next request than closing ones */
+int16_t tcp_idle_timeout(struct tcp_tcb * tcb)
+{
+  return (tcb->state == tcp_state_established) ? TCP_TIMEOUT_IDLE : TCP_TIMEOUT_MS;
+}
+
+/* Data, SYN or FIN waiting to be acknowledged */
+uint8_t tcp_outstanding(struct tcp_tcb * tcb)
+{
+  return tcb->state == tcp_state_syn_received || tcb->state == tcp_state_syn_sent || (uint16_t)(tcb->seq - tcb->tx_base) != tcb->tx_acked;
+}
+
+/* Retransmission timeout: go back to the first unacknowledged byte */
+void tcp_retransmit(struct tcp_tcb * tcb)
+{
+  uint8_t limit = TCP_RTX_DATA;
+  if(tcb->state == tcp_state_syn_received)
+    limit = TCP_RTX_SYN_ACK;
+  else if(tcb->state == tcp_state_syn_sent)
+    limit = TCP_RTX_SYN;
+  else if(tcb->tx_acked == tcb->tx_total)
+    limit = TCP_RTX_FIN;
+  if(++tcb->rtx > limit)
+  {
+    DBG_STATIC("TCP retransmission limit.");
+    if(tcb->state != tcp_state_syn_sent)
+      tcp_send_packet(tcb,TCP_FLAG_RST|TCP_FLAG_ACK,0);
+    tcp_tcb_release(tcb,tcp_event_timeout);
+    return;
+  }
+  /* back off, the estimate is only trusted again after a fresh sample */
+  tcb->rto = (tcb->rto > TCP_RTO_MAX/2) ? TCP_RTO_MAX : tcb->rto<<1;
+  tcb->flags &= ~TCP_TCB_RTT;
+  tcp_timer_set(tcb,tcb->rto);
+  if(tcb->state == tcp_state_syn_received)
+  {
+    tcp_send_packet(tcb,TCP_FLAG_SYN|TCP_FLAG_ACK,0);
+    return;
+  }
+  if(tcb->state == tcp_state_syn_sent)
+  {
+    tcp_send_packet(tcb,TCP_FLAG_SYN,0);
+    return;
+  }
+  if(tcb->flags & TCP_TCB_FIN_SENT)
+  {
+    tcb->flags &= ~TCP_TCB_FIN_SENT;
+    tcb->state = (tcb->state == tcp_state_last_ack) ? tcp_state_close_wait : tcp_state_established;
+  }
+  tcb->seq = tcb->tx_base + tcb->tx_acked;
+  tcp_output(tcb);
+}
+
+/* Jacobson/Karels round trip estimation (RFC 6298) */
+void tcp_rtt_sample(struct tcp_tcb * tcb)
+{
+  if(!(tcb->flags & TCP_TCB_RTT))
+    return;
+  tcb->flags &= ~TCP_TCB_RTT;
+  uint16_t rtt = timer_get_ticks() - tcb->rtt_start;
+  if(rtt > TCP_RTO_MAX / TIMER_MS_PER_TICK)
+    rtt = TCP_RTO_MAX / TIMER_MS_PER_TICK;
+  rtt *= TIMER_MS_PER_TICK;
+  if(tcb->srtt == 0)
+  {
+    tcb->srtt = rtt<<3;
+    tcb->rttvar = rtt<<1;
+  }
+  else
+  {
+    int16_t delta = rtt - (tcb->srtt>>3);
+    tcb->srtt += delta;
+    if(delta < 0)
+      delta = -delta;
+    delta -= (tcb->rttvar>>2);
+    tcb->rttvar += delta;
+  }
+  uint16_t rto = (tcb->srtt>>3) + tcb->rttvar;
+  if(rto < TCP_RTO_MIN)
+    rto = TCP_RTO_MIN;
+  if(rto > TCP_RTO_MAX)
+    rto = TCP_RTO_MAX;
+  tcb->rto = rto;
+}
+
+uint16_t tcp_capture(struct tcp_tcb * tcb,uint16_t offset,uint16_t limit,enum tcp_event event)
+{
+  tcp_tx.socket = tcp_get_socket_num(tcb);
+  tcp_tx.skip = offset;
+  tcp_tx.limit = limit;
+  tcp_tx.length = 0;
+  tcp_tx.count = 0;
+  tcp_tx.checksum = 0;
+  tcb->callback(tcp_tx.socket,event);
+  tcp_tx.socket = -1;
+  return tcp_tx.length;
+}
+
+uint16_t tcp_get_mss(struct tcp_tcb * tcb)
+{
+  return (tcb->mss < TCP_MSS) ? tcb->mss : TCP_MSS;
+}
+
+/*
+  The link went down: connections still being opened are given up
+  at once instead of retransmitting into the void, established ones
+  may survive a short drop.
+*/
+void tcp_link_down(void)
+{
+  struct tcp_tcb * tcb;
+  FOREACH_TCB(tcb)
+  {
+    if(tcb->state == tcp_state_syn_received || tcb->state == tcp_state_syn_sent)
+      tcp_tcb_release(tcb,tcp_event_reset);
+  }
+}
+
+void tcp_poll(void)
+{
+  struct tcp_tcb * tcb;
+  /* the cookie key changes with the counter even without SYNs */
+  tcp_seed();
+  if(tcp_delack_state == TCP_DELACK_EXPIRED)
+  {
+    tcp_delack_state = TCP_DELACK_IDLE;
+    FOREACH_TCB(tcb)
+    {
+      if(tcb->flags & TCP_TCB_ACK_PENDING)
+        tcp_send_packet(tcb,TCP_FLAG_ACK,0);
+    }
+  }
+  FOREACH_TCB(tcb)
+  {
+    if(!tcb->expired)
+      continue;
+    tcb->expired = 0;
+    if(tcp_outstanding(tcb))
+    {
+      tcp_retransmit(tcb);
+    }
+    else if(tcb->state == tcp_state_established)
+    {
+      /* no further request on a kept alive connection, close it,
+         connections opened by the application stay */
+      if(tcb->parent == TCP_PARENT_NONE)
+        continue;
+      tcb->callback(tcp_get_socket_num(tcb),tcp_event_connection_idle);
+      tcb->flags |= TCP_TCB_CLOSE;
+      tcp_output(tcb);
+    }
+    else if(tcb->state != tcp_state_listen)
+    {
+      tcp_tcb_release(tcb,tcp_event_timeout);
+    }
+  }
 }
 
 void tcp_timeout(timer_t timer,void * arg)
@@ -336,62 +1219,112 @@ void tcp_timeout(timer_t timer,void * arg)
 		return;
 	if(timer != tcb->timer)
 		return;
-  tcb->state = tcp_state_listen;
+  /* runs in interrupt context, tcp_poll() retransmits or drops the connection */
+  tcb->expired = 1;
+}
+
+/* An expiry of the previous timeout that tcp_poll() has not serviced yet
+   is stale once the timer is armed again or stopped. The flag is cleared
+   with the timer interrupt masked so that the old expiry cannot be
+   flagged in between. */
+void tcp_timer_set(struct tcp_tcb * tcb,int16_t ms)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tcb->expired = 0;
+    timer_set(tcb->timer,ms);
+  }
+}
+
+void tcp_timer_stop(struct tcp_tcb * tcb)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    tcb->expired = 0;
+    timer_stop(tcb->timer);
+  }
 }
 
+void tcp_delack_timeout(timer_t timer,void * arg)
+{
+  /* runs in interrupt context, tcp_poll() sends the ACKs */
+  tcp_delack_state = TCP_DELACK_EXPIRED;
+}
 
-uint8_t tcp_send_packet(struct tcp_tcb * tcb,uint8_t flags,uint8_t send_data)
+/* The timer is not restarted by further connections, no ACK waits longer
+   than TCP_DELAYED_ACK_MS */
+void tcp_delack_start(struct tcp_tcb * tcb)
+{
+  if(tcp_delack_state != TCP_DELACK_IDLE)
+    return;
+  if(!timer_set(tcp_delack_timer,TCP_DELAYED_ACK_MS))
+  {
+    tcp_send_packet(tcb,TCP_FLAG_ACK,0);
+    return;
+  }
+  tcp_delack_state = TCP_DELACK_ARMED;
+}
+
+
+uint8_t tcp_send_packet(struct tcp_tcb * tcb,uint8_t flags,uint16_t data_length)
 {
 	if(!tcb)
 		return 0;
+	/* every segment acknowledges all received data */
+	if(flags & TCP_FLAG_ACK)
+		tcb->flags &= ~TCP_TCB_ACK_PENDING;
+	/* set window to what will be taken */
+	return tcp_send_segment((const ip_address*)&tcb->ip_remote,tcb->port_local,tcb->port_remote,tcb->seq,tcb->ack,flags,tcp_get_window(tcb),data_length);
+}
+
+/* Builds the header in front of the payload written by tcp_stream() and
+   sends the segment, needs no TCB */
+uint8_t tcp_send_segment(const ip_address * ip_remote,uint16_t port_local,uint16_t port_remote,uint32_t seq,uint32_t ack,uint8_t flags,uint16_t window,uint16_t data_length)
+{
 	struct tcp_header * tcp = (struct tcp_header*)ip_get_buffer();
  
 	memset(tcp,0,sizeof(struct tcp_header));
 	/* set destination port */
-	tcp->port_destination = hton16(tcb->port_remote);
+	tcp->port_destination = hton16(port_remote);
 	/* set source port */
-	tcp->port_source = hton16(tcb->port_local);
+	tcp->port_source = hton16(port_local);
 	/* not using urgent */
 	tcp->urgent = HTON16(0x0000);
 	/* set acknowledgment number */
-	tcp->ack = hton32(tcb->ack);
+	tcp->ack = hton32(ack);
 	/* set flags */
 	tcp->flags = flags;
-	/* set window to buffer free space length */
-	tcp->window = hton16(TCB_RX_BUFFERSIZE);
+	tcp->window = hton16(window);
 	uint16_t packet_header_len = sizeof(struct tcp_header);
-	uint16_t max_packet_size = tcp_get_buffer_size();
 	uint8_t * data_ptr = (uint8_t*)tcp + sizeof(struct tcp_header);
-	/* if SYN packet send maximum segment size in options field */
+	/* if SYN packet send maximum segment size in options field,
+	   a SYN never carries data so the option does not overlap the payload */
 	if(tcp->flags & TCP_FLAG_SYN)
 	{
     *((uint32_t*)data_ptr) = HTON32(((uint32_t)TCP_OPT_MSS<<24)|((uint32_t)TCP_OPT_LENGTH_MSS<<16)|(uint32_t)TCP_MSS);
-    data_ptr += sizeof(uint32_t);
     packet_header_len += sizeof(uint32_t);
-    max_packet_size -= sizeof(uint32_t);
 	}
 	
 	tcp->offset = (packet_header_len>>2)<<4;
-	uint8_t packet_sent = 1;	
-	uint16_t packet_total_len;
-	uint16_t data_length = 0;
-  if(send_data)
+	/* the payload has already been written behind the header by tcp_stream() */
+	uint16_t packet_total_len = data_length + packet_header_len;
+  
+  tcp->seq = hton32(seq);
+  uint16_t checksum = tcp_get_pseudo_checksum(ip_remote,packet_total_len);
+  checksum = net_get_checksum(checksum,(const uint8_t*)tcp,packet_header_len,16);
+  if(data_length > 0)
   {
-    data_length = tcb->TxLength;
-    memcpy(data_ptr, (const uint8_t*)tcb->TxData, data_length);
-    tcb->TxLength = 0;
+#if NET_CHECKSUM_OFFLOAD
+    tcp_tx.checksum = ethernet_tx_checksum(NET_HEADER_SIZE_IP + sizeof(struct tcp_header),data_length);
+#endif
+    checksum = net_add_checksum(checksum,tcp_tx.checksum);
   }
-  packet_total_len = data_length + packet_header_len;
-  tcp->flags = flags;
-  
-  tcp->seq = hton32(tcb->seq);
-  tcp->checksum = hton16(tcp_get_checksum((const ip_address*)&tcb->ip_remote,tcp,packet_total_len));
+  tcp->checksum = hton16(~checksum);
   
   DBG_STATIC("Trasmitting TCP:");
   //tcp_print_packet(tcp, packet_total_len);
   
-  packet_sent = ip_send_packet((const ip_address*)&tcb->ip_remote,IP_PROTOCOL_TCP,packet_total_len);
-	return packet_sent;
+	return ip_send_frame(ip_remote,IP_PROTOCOL_TCP,packet_total_len,packet_header_len);
 }
 
 uint8_t tcp_send_rst(const ip_address * ip_remote,const struct tcp_header * tcp_rcv,uint16_t length)
@@ -402,18 +1335,37 @@ uint8_t tcp_send_rst(const ip_address * ip_remote,const struct tcp_header * tcp_
 		return 0;
 	if(tcp_rcv->flags & TCP_FLAG_RST)
 		return 0;
+	/* the reset is built over the received segment, keep what is needed */
+	ip_address ip;
+	memcpy(ip,ip_remote,sizeof(ip_address));
+	uint16_t port_source = tcp_rcv->port_source;
+	uint16_t port_destination = tcp_rcv->port_destination;
+	uint8_t flags = tcp_rcv->flags;
+	uint32_t seq = tcp_rcv->ack;
+	/* words of a segment without options the reset changes */
+	uint16_t checksum = ntoh16(tcp_rcv->checksum);
+	uint32_t seq_rcv = ntoh32(tcp_rcv->seq);
+	uint16_t offset_flags = MAKEUINT16(tcp_rcv->offset,flags);
+	uint16_t window = ntoh16(tcp_rcv->window);
+	uint16_t urgent = ntoh16(tcp_rcv->urgent);
+	/* SYN and FIN occupy a sequence number too */
+	uint32_t ack = ntoh32(tcp_rcv->seq) + length - ((tcp_rcv->offset>>4)<<2);
+	if(flags & TCP_FLAG_SYN)
+		ack++;
+	if(flags & TCP_FLAG_FIN)
+		ack++;
 	struct tcp_header * tcp_rst = (struct tcp_header*)ip_get_buffer();
 	memset(tcp_rst,0,sizeof(struct tcp_header));
-	tcp_rst->port_destination = tcp_rcv->port_source;
-	tcp_rst->port_source = tcp_rcv->port_destination;
+	tcp_rst->port_destination = port_source;
+	tcp_rst->port_source = port_destination;
 	/* the number of 32-bit owrds shifted by 4 positions due to reserved bits*/
 	tcp_rst->offset = (sizeof(struct tcp_header)/4)<<4;
 	
-	if(tcp_rcv->flags & TCP_FLAG_ACK)
+	if(flags & TCP_FLAG_ACK)
 	{
 		/*If the incoming segment has an ACK field, the reset takes its
 			sequence number from the ACK field of the segment..*/
-		tcp_rst->seq = tcp_rcv->ack;
+		tcp_rst->seq = seq;
 		tcp_rst->flags = TCP_FLAG_RST;
 	}
 	else
@@ -421,13 +1373,25 @@ uint8_t tcp_send_rst(const ip_address * ip_remote,const struct tcp_header * tcp_
 		/*..otherwise 
 		the reset has sequence number zero and the ACK field is set to the sum
 		of the sequence number and segment length of the incoming segment*/
-		uint32_t ack = ntoh32(tcp_rcv->seq) + length - ((tcp_rcv->offset>>4)<<2);
-
 		tcp_rst->flags = TCP_FLAG_RST | TCP_FLAG_ACK;
 		tcp_rst->ack = hton32(ack);
 	}
-	tcp_rst->checksum = hton16(tcp_get_checksum(ip_remote,tcp_rst,sizeof(struct tcp_header)));
-	return ip_send_packet(ip_remote,IP_PROTOCOL_TCP,sizeof(struct tcp_header));
+	if(length == sizeof(struct tcp_header))
+	{
+		/* swapping the ports and addresses keeps the sum, adjust
+		   the checksum of the received segment for the rest */
+		checksum = net_adjust_checksum32(checksum,seq_rcv,ntoh32(tcp_rst->seq));
+		checksum = net_adjust_checksum32(checksum,ntoh32(seq),ntoh32(tcp_rst->ack));
+		checksum = net_adjust_checksum(checksum,offset_flags,MAKEUINT16(tcp_rst->offset,tcp_rst->flags));
+		checksum = net_adjust_checksum(checksum,window,0);
+		checksum = net_adjust_checksum(checksum,urgent,0);
+		tcp_rst->checksum = hton16(checksum);
+	}
+	else
+	{
+		tcp_rst->checksum = hton16(tcp_get_checksum((const ip_address*)&ip,tcp_rst,sizeof(struct tcp_header)));
+	}
+	return ip_send_packet((const ip_address*)&ip,IP_PROTOCOL_TCP,sizeof(struct tcp_header));
 }
 
 tcp_socket_t tcp_get_socket_num(struct tcp_tcb * tcb)
@@ -438,12 +1402,25 @@ tcp_socket_t tcp_get_socket_num(struct tcp_tcb * tcb)
   return -1;
 }
 
+/* Local ports for active opens, from the dynamic range (RFC 6335) */
+uint16_t tcp_ephemeral_port(void)
+{
+  static uint16_t port = 49152;
+  do
+  {
+    if(++port < 49152)
+      port = 49152;
+  }
+  while(!tcp_free_port(port));
+  return port;
+}
+
 uint8_t tcp_free_port(uint16_t port)
 {
   struct tcp_tcb * tcb;
   FOREACH_TCB(tcb)
   {
-    if(tcb->state != tcp_state_unused && tcb->port_local == port)
+    if(tcb->state != tcp_state_unused && tcb->parent == TCP_PARENT_NONE && tcb->port_local == port)
       return 0;
   }	
   return 1;
@@ -462,9 +1439,193 @@ void tcp_tcb_free(struct tcp_tcb * tcb)
 {
 	if(!tcp_tcb_valid(tcb))
 		return;
+  tcp_socket_t socket = tcp_get_socket_num(tcb);
+  struct tcp_tcb * child;
+  if(tcb->parent >= 0)
+  {
+    if(tcb->state == tcp_state_syn_received)
+      tcp_tcbs[tcb->parent].backlog--;
+  }
+  else
+  {
+    /* established connections outlive their listening socket,
+       half-open ones are reset with it; the slot may be reused, so the
+       survivors no longer refer to it */
+    FOREACH_TCB(child)
+    {
+      if(child->parent != socket)
+        continue;
+      if(child->state == tcp_state_syn_received)
+        tcp_tcb_release(child,tcp_event_reset);
+      else
+        child->parent = TCP_PARENT_GONE;
+    }
+  }
+  tcp_hash_remove(tcb);
 	tcb->state = tcp_state_unused;
   timer_free(tcb->timer);
 	memset(tcb,0,sizeof(struct tcp_tcb));
+  tcb->timer = TIMER_INVALID;
+  tcb->parent = TCP_PARENT_NONE;
+  tcb->hash_next = -1;
+}
+
+void tcp_tcb_release(struct tcp_tcb * tcb,enum tcp_event event)
+{
+  tcp_socket_callback callback = tcb->callback;
+  uint8_t owned = (tcb->parent == TCP_PARENT_NONE);
+  tcp_tcb_free(tcb);
+  if(owned)
+  {
+    /* a socket the application allocated stays with it and may connect again */
+    tcb->callback = callback;
+    tcb->state = tcp_state_closed;
+  }
+  callback(tcp_get_socket_num(tcb),event);
+}
+
+/* Takes the free slot or the one expiring first */
+void tcp_time_wait_enter(struct tcp_tcb * tcb)
+{
+  uint16_t now = timer_get_ticks();
+  struct tcp_time_wait * slot = &tcp_time_waits[0];
+  struct tcp_time_wait * tw;
+  for(tw = &tcp_time_waits[0] ; tw < &tcp_time_waits[TCP_TIME_WAIT_SLOTS] ; tw++)
+  {
+    if(tw->port_remote == 0 || (int16_t)(tw->expiry - now) <= 0)
+    {
+      slot = tw;
+      break;
+    }
+    if((int16_t)(tw->expiry - slot->expiry) < 0)
+      slot = tw;
+  }
+  memcpy(slot->ip_remote,tcb->ip_remote,sizeof(ip_address));
+  slot->port_local = tcb->port_local;
+  slot->port_remote = tcb->port_remote;
+  slot->expiry = now + TCP_TIMEOUT_TIME_WAIT / TIMER_MS_PER_TICK;
+  slot->ack = tcb->ack;
+}
+
+/* Answers late segments of a closed connection, 1 if the segment was consumed */
+uint8_t tcp_time_wait_handle(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
+{
+  uint16_t now = timer_get_ticks();
+  uint16_t port_local = ntoh16(tcp->port_destination);
+  uint16_t port_remote = ntoh16(tcp->port_source);
+  struct tcp_time_wait * tw;
+  for(tw = &tcp_time_waits[0] ; tw < &tcp_time_waits[TCP_TIME_WAIT_SLOTS] ; tw++)
+  {
+    if(tw->port_remote != port_remote || tw->port_local != port_local)
+      continue;
+    if(memcmp(tw->ip_remote,ip_remote,sizeof(ip_address)))
+      continue;
+    if((int16_t)(tw->expiry - now) <= 0 || (tcp->flags & TCP_FLAG_RST))
+    {
+      tw->port_remote = 0;
+      return (tcp->flags & TCP_FLAG_RST) ? 1 : 0;
+    }
+    if(tcp->flags & TCP_FLAG_SYN)
+    {
+      /* a new incarnation must start beyond the old one (RFC 1122) */
+      if((int32_t)(ntoh32(tcp->seq) - tw->ack) <= 0)
+        return 1;
+      tw->port_remote = 0;
+      return 0;
+    }
+    if(length > (uint16_t)((tcp->offset>>4)<<2) || (tcp->flags & TCP_FLAG_FIN))
+    {
+      /* our last ACK got lost, send it again and restart the wait,
+         the reply overwrites the received headers */
+      ip_address ip;
+      memcpy(ip,ip_remote,sizeof(ip_address));
+      uint16_t port_source = tcp->port_source;
+      uint16_t port_destination = tcp->port_destination;
+      uint32_t seq = tcp->ack;
+      struct tcp_header * ack = (struct tcp_header*)ip_get_buffer();
+      memset(ack,0,sizeof(struct tcp_header));
+      ack->port_destination = port_source;
+      ack->port_source = port_destination;
+      ack->offset = (sizeof(struct tcp_header)/4)<<4;
+      ack->seq = seq;
+      ack->ack = hton32(tw->ack);
+      ack->flags = TCP_FLAG_ACK;
+      ack->window = hton16(TCP_RX_WINDOW);
+      ack->checksum = hton16(tcp_get_checksum((const ip_address*)&ip,ack,sizeof(struct tcp_header)));
+      tw->expiry = now + TCP_TIMEOUT_TIME_WAIT / TIMER_MS_PER_TICK;
+      ip_send_packet((const ip_address*)&ip,IP_PROTOCOL_TCP,sizeof(struct tcp_header));
+    }
+    /* duplicate ACKs are dropped */
+    return 1;
+  }
+  return 0;
+}
+
+struct tcp_tcb * tcp_tcb_spawn(struct tcp_tcb * listener)
+{
+  struct tcp_tcb * tcb;
+  FOREACH_TCB(tcb)
+  {
+    if(tcb->state != tcp_state_unused)
+      continue;
+    tcb->timer = timer_alloc(tcp_timeout,TCP_TIMEOUT_MS);
+    if(tcb->timer == TIMER_INVALID)
+      return 0;
+    timer_set_arg(tcb->timer,(void*)tcb);
+    tcb->expired = 0;
+    tcb->callback = listener->callback;
+    tcb->port_local = listener->port_local;
+    tcb->parent = tcp_get_socket_num(listener);
+    tcb->state = tcp_state_closed;
+    return tcb;
+  }
+  return 0;
+}
+
+uint8_t tcp_hash_key(const ip_address * ip_remote,uint16_t port_local,uint16_t port_remote)
+{
+  const uint8_t * ip = (const uint8_t*)ip_remote;
+  uint8_t key = ip[0] ^ ip[1] ^ ip[2] ^ ip[3];
+  key ^= (uint8_t)port_local ^ (uint8_t)(port_local>>8);
+  key ^= (uint8_t)port_remote ^ (uint8_t)(port_remote>>8);
+  return (key ^ (key>>4)) & (TCP_HASH_SIZE-1);
+}
+
+void tcp_hash_insert(struct tcp_tcb * tcb)
+{
+  uint8_t key = tcp_hash_key((const ip_address*)&tcb->ip_remote,tcb->port_local,tcb->port_remote);
+  tcb->hash_next = tcp_hash[key];
+  tcp_hash[key] = tcp_get_socket_num(tcb);
+}
+
+void tcp_hash_remove(struct tcp_tcb * tcb)
+{
+  tcp_socket_t socket = tcp_get_socket_num(tcb);
+  tcp_socket_t * link = &tcp_hash[tcp_hash_key((const ip_address*)&tcb->ip_remote,tcb->port_local,tcb->port_remote)];
+  while(*link >= 0)
+  {
+    if(*link == socket)
+    {
+      *link = tcb->hash_next;
+      break;
+    }
+    link = &tcp_tcbs[*link].hash_next;
+  }
+  tcb->hash_next = -1;
+}
+
+struct tcp_tcb * tcp_lookup(const ip_address * ip_remote,uint16_t port_local,uint16_t port_remote)
+{
+  tcp_socket_t socket = tcp_hash[tcp_hash_key(ip_remote,port_local,port_remote)];
+  while(socket >= 0)
+  {
+    struct tcp_tcb * tcb = &tcp_tcbs[socket];
+    if(tcb->port_local == port_local && tcb->port_remote == port_remote &&
+       !memcmp(&tcb->ip_remote,ip_remote,sizeof(ip_address)))
+      return tcb;
+    socket = tcb->hash_next;
+  }
+  return 0;
 }
 
 uint8_t tcp_socket_valid(tcp_socket_t socket)
@@ -477,13 +1638,15 @@ uint8_t tcp_tcb_valid(struct tcp_tcb * tcb)
 		return (tcb && tcb >= &tcp_tcbs[0] && tcb < &tcp_tcbs[TCP_MAX_SOCKETS]);
 }
 
-uint8_t tcp_get_options(struct tcp_tcb * tcb,const struct tcp_header * tcp,uint16_t length)
+/* Returns the peer's maximum segment size option, mss if there is none */
+uint16_t tcp_get_options(const struct tcp_header * tcp,uint16_t length,uint16_t mss)
 {
-		if(!tcb || !tcp || length < sizeof(struct tcp_header))
-			return 0;
+		if(!tcp || length < sizeof(struct tcp_header))
+			return mss;
 		uint16_t offset = (tcp->offset>>4)<<2;
 		uint8_t * options = (uint8_t*)tcp + sizeof(struct tcp_header);
 		uint8_t * options_end = (uint8_t*)tcp + offset;
+		ethernet_rx_fetch(options_end);
 		for(;options < options_end;options++)
 		{
 			if(*options == TCP_OPT_EOL)
@@ -499,7 +1662,7 @@ uint8_t tcp_get_options(struct tcp_tcb * tcb,const struct tcp_header * tcp,uint1
 			{
 				/* maximum segment size */
 				options+=2;
-				tcb->mss = ntoh16(*((uint16_t*)options));
+				mss = ntoh16(*((uint16_t*)options));
 				options++;
 			}
 			else
@@ -507,78 +1670,156 @@ uint8_t tcp_get_options(struct tcp_tcb * tcb,const struct tcp_header * tcp,uint1
 					options += *(options+1);
 			}
 		}
-		return 1;
+		return mss;
 }
 
 const uint8_t* tcp_read(tcp_socket_t socket, uint16_t* len)
 {
-  struct tcp_tcb * tcb = &tcp_tcbs[socket];
-  if(!tcp_socket_valid(socket)){
+  if(!tcp_socket_valid(socket) || socket != tcp_rx.socket){
     *len = 0;
-  } else {
-    *len = tcb->RxLength;
+    return 0;
   }
-  return (const uint8_t*)tcb->RxData;
+  *len = tcp_rx.length;
+  return (const uint8_t*)tcp_rx.data;
 }
 
 uint16_t tcp_write(tcp_socket_t socket, const uint8_t * data)
 {
   if(!tcp_socket_valid(socket))
 		return -1;
-	struct tcp_tcb * tcb = &tcp_tcbs[socket];
-  
-  struct tcp_header * tcp = (struct tcp_header*)ip_get_buffer();
-  uint16_t max_packet_size = tcp_get_buffer_size();
-  uint8_t * data_ptr = (uint8_t*)tcp + sizeof(struct tcp_header);
-  data_ptr += sizeof(uint32_t);
-  max_packet_size -= sizeof(uint32_t);
-  
-  tcb->TxData = data_ptr;
-  
-  uint8_t c;
-  while ((c = *data)) 
-  {
-    if(tcb->TxLength < max_packet_size){
-      tcb->TxData[tcb->TxLength++] = c;
-      data++;
-    } else {
-      DBG_STATIC("Reply too big.");
-      break;
-    }
-  }
-	return tcb->TxLength;
+  if(socket != tcp_tx.socket)
+    return 0;
+  tcp_stream(data,strlen((const char*)data),0);
+	return tcp_tx.count;
 }
 
 uint16_t tcp_write_p(tcp_socket_t socket, const uint8_t * data_p)
 {
 	if(!tcp_socket_valid(socket))
 		return -1;
-	struct tcp_tcb * tcb = &tcp_tcbs[socket];
-  
-  struct tcp_header * tcp = (struct tcp_header*)ip_get_buffer();
-  uint16_t max_packet_size = tcp_get_buffer_size();
-  uint8_t * data_ptr = (uint8_t*)tcp + sizeof(struct tcp_header);
-  data_ptr += sizeof(uint32_t);
-  max_packet_size -= sizeof(uint32_t);
-  
-  tcb->TxData = data_ptr;
-  
-  uint8_t c;
-  while ((c = pgm_read_byte(data_p++))) 
+  if(socket != tcp_tx.socket)
+    return 0;
+  tcp_stream(data_p,strlen_P((const char*)data_p),1);
+	return tcp_tx.count;
+}
+
+uint8_t tcp_cache_p(struct tcp_cache * cache, const uint8_t * data_p)
+{
+  cache->data_p = data_p;
+  cache->length = strlen_P((const char*)data_p);
+#if NET_CHECKSUM_OFFLOAD
+  cache->position = ethernet_cache_store_p(data_p,cache->length);
+#else
+  /* only the DMA engine could sum a copy made inside the controller */
+  cache->position = ETHERNET_CACHE_NONE;
+#endif
+  return cache->position != ETHERNET_CACHE_NONE;
+}
+
+uint16_t tcp_write_cached(tcp_socket_t socket, const struct tcp_cache * cache)
+{
+	if(!tcp_socket_valid(socket))
+		return -1;
+  if(socket != tcp_tx.socket)
+    return 0;
+#if NET_CHECKSUM_OFFLOAD
+  if(cache->position != ETHERNET_CACHE_NONE)
   {
-    if(tcb->TxLength < max_packet_size){
-      tcb->TxData[tcb->TxLength++] = c;
-    } else {
-      DBG_STATIC("Reply too big.");
-      break;
-    }
+    tcp_stream_cached(cache);
+    return tcp_tx.count;
   }
-	return tcb->TxLength;
-  
+#endif
+  /* the payload checksum is summed while writing, so without offload
+     the data has to pass through anyway */
+  tcp_stream(cache->data_p,cache->length,1);
+	return tcp_tx.count;
+}
+
+/* Cuts a piece of the written stream down to the part that belongs to the
+   segment being built, returns 0 if nothing does */
+uint8_t tcp_stream_clip(uint16_t * skip,uint16_t * length)
+{
+  uint16_t start = tcp_tx.count;
+  tcp_tx.count += *length;
+  if(tcp_tx.count <= tcp_tx.skip || tcp_tx.length >= tcp_tx.limit)
+    return 0;
+  *skip = 0;
+  if(start < tcp_tx.skip)
+  {
+    *skip = tcp_tx.skip - start;
+    *length -= *skip;
+  }
+  if(*length > tcp_tx.limit - tcp_tx.length)
+    *length = tcp_tx.limit - tcp_tx.length;
+  if(tcp_tx.length == 0)
+    ethernet_tx_seek(NET_HEADER_SIZE_IP + sizeof(struct tcp_header));
+  return 1;
+}
+
+/* Copies the part of the written data that belongs to the segment being built */
+void tcp_stream(const uint8_t * data,uint16_t length,uint8_t progmem)
+{
+  uint16_t skip;
+  if(!tcp_stream_clip(&skip,&length))
+    return;
+  data += skip;
+  if(!progmem)
+  {
+    tcp_stream_write(data,length);
+    return;
+  }
+  /* flash is summed up through a small bounce buffer */
+  uint8_t chunk[32];
+  while(length > 0)
+  {
+    uint8_t chunk_length = (length > sizeof(chunk)) ? sizeof(chunk) : length;
+    memcpy_P(chunk,data,chunk_length);
+    tcp_stream_write(chunk,chunk_length);
+    data += chunk_length;
+    length -= chunk_length;
+  }
+}
+
+#if NET_CHECKSUM_OFFLOAD
+/* Same for cached data, copied inside the controller */
+void tcp_stream_cached(const struct tcp_cache * cache)
+{
+  uint16_t skip;
+  uint16_t length = cache->length;
+  if(!tcp_stream_clip(&skip,&length))
+    return;
+  uint16_t offset = NET_HEADER_SIZE_IP + sizeof(struct tcp_header) + tcp_tx.length;
+  ethernet_cache_copy(cache->position + skip,length,offset);
+  tcp_tx.length += length;
+  /* the copy does not move the write pointer */
+  ethernet_tx_seek(offset + length);
+}
+#endif
+
+/* Writes to the controller behind the previous segment data */
+void tcp_stream_write(const uint8_t * data,uint16_t length)
+{
+#if !NET_CHECKSUM_OFFLOAD
+  /* summed while it is written */
+  uint16_t sum = ethernet_tx_write_sum(data,length);
+  /* data starting on an odd offset is summed with swapped bytes */
+  if(tcp_tx.length & 1)
+    sum = (sum<<8) | (sum>>8);
+  tcp_tx.checksum = net_add_checksum(tcp_tx.checksum,sum);
+#else
+  ethernet_tx_write(data,length);
+#endif
+  tcp_tx.length += length;
 }
 
 
 uint16_t tcp_get_checksum(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length)
+{
+	/* TCP header + data */
+	return ~net_get_checksum(tcp_get_pseudo_checksum(ip_remote,length),(const uint8_t*)tcp,length,16);
+}
+
+uint16_t tcp_get_pseudo_checksum(const ip_address * ip_remote,uint16_t length)
 {
     /* tcp pseudo header :
              +--------+--------+--------+--------+
@@ -595,8 +1836,6 @@ uint16_t tcp_get_checksum(const ip_address * ip_remote,const struct tcp_header *
 	checksum = net_get_checksum(checksum,(const uint8_t*)ip_remote,sizeof(ip_address),4);
 	/* our ip address */
 	checksum = net_get_checksum(checksum,(const uint8_t*)ip_get_addr(),sizeof(ip_address),4);
-	
-	/* TCP header + data */
-	return ~net_get_checksum(checksum,(const uint8_t*)tcp,length,16);
+	return checksum;
 }
 
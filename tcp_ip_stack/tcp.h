@@ -27,6 +27,8 @@ enum tcp_event
 	tcp_event_reset,
 	tcp_event_data_received,
 	tcp_event_data_acked,
+	tcp_event_data_send,
+	tcp_event_data_regenerate,
 	tcp_event_connection_closing,
 	tcp_event_connection_closed,
 	tcp_event_connection_idle
@@ -42,16 +44,51 @@ struct tcp_header;
 
 uint8_t tcp_init(void);
 uint8_t tcp_handle_packet(const ip_address * ip_remote,const struct tcp_header * tcp,uint16_t length);
+void tcp_poll(void);
+void tcp_link_down(void);
+/* noise for the keys of the SYN cookies and initial sequence numbers */
+void tcp_add_entropy(uint16_t noise);
 
 tcp_socket_t tcp_socket_alloc(tcp_socket_callback callback);
 uint8_t tcp_socket_free(tcp_socket_t socket);
 
 uint8_t tcp_listen(tcp_socket_t socket,uint16_t port);
+uint8_t tcp_connect(tcp_socket_t socket,const ip_address * ip_remote,uint16_t port);
+uint8_t tcp_send(tcp_socket_t socket);
+uint8_t tcp_close(tcp_socket_t socket);
 
 const uint8_t * tcp_read(tcp_socket_t socket, uint16_t* len);
+
+/*
+ * Replies are not buffered. On tcp_event_data_received, tcp_event_data_send
+ * and tcp_event_data_regenerate (a lost segment is sent again) the application
+ * writes its whole reply, the stack keeps only the bytes that belong to the
+ * segment being sent. The reply must be the same every time.
+ * The reply goes straight into the controller, data returned by tcp_read()
+ * stays valid until the callback returns.
+ * A request may arrive in several tcp_event_data_received, writing nothing
+ * takes the data without replying.
+ * The connection stays open for further requests until tcp_close() is called,
+ * the FIN then follows the reply.
+ */
 uint16_t tcp_write(tcp_socket_t socket, const uint8_t * data);
 uint16_t tcp_write_p(tcp_socket_t socket, const uint8_t * data_p);
 
+/*
+ * Flash data written with every reply, like a static page, can be kept in
+ * the controller once by tcp_cache_p(), tcp_write_cached() then copies it
+ * into the segment inside the controller. Data that does not fit into the
+ * cache is written from flash.
+ */
+struct tcp_cache
+{
+	const uint8_t * data_p;
+	uint16_t length;
+	uint16_t position;
+};
+uint8_t tcp_cache_p(struct tcp_cache * cache, const uint8_t * data_p);
+uint16_t tcp_write_cached(tcp_socket_t socket, const struct tcp_cache * cache);
+
 
 #define tcp_get_buffer_size() 	(ip_get_buffer_size() - sizeof(struct tcp_header))
 
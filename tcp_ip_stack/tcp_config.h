@@ -12,17 +12,44 @@
 #include <net.h>
 #include <webb_config.h>
 
-#define TCP_MAX_SOCKETS		1
-#define TCB_RX_BUFFERSIZE 1500
-#define TCB_TX_BUFFERSIZE 1500
+/* listening sockets and the connections spawned from them share this pool,
+   the web server's listener and three connections, plus the collector's */
+#if COLLECTOR_ENABLED
+#define TCP_MAX_SOCKETS		5
+#else
+#define TCP_MAX_SOCKETS		4
+#endif
+/* number of spawned connections a listening socket may hold in SYN received */
+#define TCP_SYN_BACKLOG		2
+/* answer SYNs statelessly once the backlog is full */
+#define TCP_SYN_COOKIES		1
+/* buckets of the 4-tuple demultiplexing table, must be a power of two */
+#define TCP_HASH_SIZE		4
 
 #define TCP_MSS			(ETHERNET_MAX_PACKET_SIZE - NET_HEADER_SIZE_ETHERNET - NET_HEADER_SIZE_IP - NET_HEADER_SIZE_TCP)	
+/* measure tcp_handle_packet() with timer 1 and report the average cycles
+   of the fast and the slow path every TCP_BENCHMARK segments, 0 disables */
+#define TCP_BENCHMARK		0
+/* received segments wait in the controller's receive buffer until they
+   are handed to the application one by one */
+#define TCP_RX_WINDOW		(2 * TCP_MSS)
 
 // #define TCP_TIMEOUT_GENERIC 	100
 // #define TCP_TIMEOUT_ARP_MAC	100
-// #define TCP_TIMEOUT_IDLE	250
-// #define TCP_TIMEOUT_TIME_WAIT	100
 #define TCP_TIMEOUT_MS 1000
+/* a kept alive connection without requests is closed after this time */
+#define TCP_TIMEOUT_IDLE 10000
+/* a request without immediate reply is acknowledged after this time */
+#define TCP_DELAYED_ACK_MS 200
+/* closed connections are remembered this long to answer late segments,
+   at most 320 s */
+#define TCP_TIMEOUT_TIME_WAIT	30000
+#define TCP_TIME_WAIT_SLOTS	2
+
+/* retransmission timeout bounds, adapted to the measured round trip time */
+#define TCP_RTO_INIT		1000
+#define TCP_RTO_MIN		200
+#define TCP_RTO_MAX		8000
 
 #define TCP_RTX_ARP_MAC		4
 /* number of allowed retransmission of SYN, ACK packet */
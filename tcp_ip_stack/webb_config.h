@@ -5,6 +5,25 @@
 #define NET_ICMP	1
 #define NET_UDP		0
 #define NET_TCP		1
+/* compute payload checksums with the controller's DMA engine on the
+   data in its buffer memory, 0 sums them in software while the bytes
+   move over SPI. The ENC28J60 errata report frames lost when one is
+   received while the engine computes a checksum, only enable this on
+   silicon known to be unaffected */
+#define NET_CHECKSUM_OFFLOAD	0
+/* bytes of a received frame copied before it is handled, enough for the
+   ethernet, ip and tcp headers, the rest is fetched when it is used */
+#define ETHERNET_RX_HEADER	(NET_HEADER_SIZE_ETHERNET + NET_HEADER_SIZE_IP + NET_HEADER_SIZE_TCP)
+/* bytes of a frame kept in RAM, the headers with all options and a window
+   the payload is read into piece by piece, see ethernet_rx_window() */
+#define ETHERNET_BUFFER_SIZE	256
+/* broadcasts the controller lets through, ETHERNET_BROADCAST_NONE,
+   _ARP or _ALL, ARP requests are needed to be reachable */
+#define ETHERNET_RX_BROADCAST	ETHERNET_BROADCAST_ARP
+/* accept multicast groups joined with ethernet_multicast_join() */
+#define ETHERNET_RX_MULTICAST	0
+/* received frames handled per main loop pass, timers run in between */
+#define ETHERNET_RX_BURST	4
 
 #define MAC_ADDRESS {0x19,0x21,0x68,0x00,0x00,0x29}
 
@@ -13,4 +32,20 @@
 #define NET_IP_GATEWAY	{169,254,222,1}
 #define WEBB_PORT 80
 
+/* report the SPI buffer throughput at startup, averaged over this
+   many bursts of each size, 0 disables */
+#define SPI_BENCHMARK		0
+/* check the assembler checksum kernel against a plain C fold and report
+   its cycles per byte at startup, averaged over this many sums, 0 disables */
+#define CHECKSUM_BENCHMARK	0
+/* print the SPI transactions per received or sent frame every this many
+   ms, needs ENC28J60_SPI_COUNT in enc28j60.h, 0 disables */
+#define SPI_COUNT_REPORT_MS	0
+
+/* push the temperature to a collector over a long lived connection */
+#define COLLECTOR_ENABLED	0
+#define COLLECTOR_IP		{169,254,222,1}
+#define COLLECTOR_PORT		5000
+#define COLLECTOR_INTERVAL_MS	10000
+
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 
 #include "../debug.h"
 #include <timer.h>
+#include <util/atomic.h>
 
 #define TIMER_STATE_UNUSED 	0
 #define TIMER_STATE_STOPPED 	1
@@ -24,6 +25,8 @@ struct timer_core
 };
 
 static struct timer_core timer_cores[TIMER_MAX];
+/* free running tick counter, wraps every 655 seconds */
+static volatile uint16_t timer_ticks;
 static timer_t timer_number(const struct timer_core * timer);
 static uint8_t timer_valid(const timer_t timer);
 
@@ -41,6 +44,7 @@ void timer_init(void)
 void timer_tick()
 {
   struct timer_core * timer;
+  timer_ticks++;
   FOREACH_TIMER(timer)
   {
     /* Skip unused timers (without callback) */
@@ -58,6 +62,16 @@ void timer_tick()
   }
 }
 
+uint16_t timer_get_ticks(void)
+{
+  uint16_t ticks;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    ticks = timer_ticks;
+  }
+  return ticks;
+}
+
 uint8_t timer_set_arg(timer_t timer,void * arg)
 {
   if(!timer_valid(timer))
@@ -82,9 +96,13 @@ uint8_t timer_set(timer_t timer, int16_t ms)
 {
   if(!timer_valid(timer) || ms < 0)
     return 0;
-  timer_cores[timer].ms_left = ms;
-  timer_cores[timer].ms_timeout = ms;
-  timer_cores[timer].state = TIMER_STATE_RUNNING;
+  /* timer_tick() reads ms_left from the interrupt, a byte at a time */
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    timer_cores[timer].ms_left = ms;
+    timer_cores[timer].ms_timeout = ms;
+    timer_cores[timer].state = TIMER_STATE_RUNNING;
+  }
   return 1;
 }
 
@@ -100,8 +118,11 @@ uint8_t timer_reset(timer_t timer)
 {
   if(!timer_valid(timer))
     return 0;
-  timer_cores[timer].ms_left = timer_cores[timer].ms_timeout;
-  timer_cores[timer].state = TIMER_STATE_RUNNING;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    timer_cores[timer].ms_left = timer_cores[timer].ms_timeout;
+    timer_cores[timer].state = TIMER_STATE_RUNNING;
+  }
   return 1;  
 }
 
@@ -15,10 +15,12 @@
 #include "timer_config.h"
 
 typedef uint8_t timer_t;
+#define TIMER_INVALID	((timer_t)-1)
 typedef void (*timer_callback_t)(timer_t timer,void * arg);
 
 void timer_init(void);
 void timer_tick(void);
+uint16_t timer_get_ticks(void);
 uint8_t timer_set(timer_t timer, int16_t ms);
 uint8_t timer_stop(timer_t timer);
 uint8_t timer_reset(timer_t timer);
@@ -11,7 +11,9 @@
 #define _TIMER_CONFIG_H
 
 
-#define TIMER_MAX		2
+/* one per TCP connection, the delayed ACK and the temperature sampler,
+   listening sockets need none */
+#define TIMER_MAX		6
 #define TIMER_MS_PER_TICK	10
 
 #endif //_TIMER_CONFIG_H